@@ -1,10 +1,24 @@
 #include "commands.h"
+#include "embedded_symbols.h"
+#include "log.h"
+#include "round_trip_verifier.h"
+#include "sweep_cache.h"
 #include "symbol_database.h"
+#include "symbol_database_compaction.h"
+#include "symbol_database_watcher.h"
+#include "symbol_journal.h"
+#include "symbol_vp_tree.h"
+#include "trace.h"
 #include "untex_img.h"
+#include "untex_shard.h"
 #include "utilities.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <filesystem>
+#include <sstream>
+#include <string_view>
 #include <unistd.h>
 
 using std::cerr;
@@ -29,6 +43,18 @@ inline string failed_symbol_file(int group) {
 	return "symbol_" + std::to_string(group);
 }
 
+// Adds symbols from the database file @p filename and its journal or, if
+// neither exists, from @p embedded. Returns false iff. none of them is
+// available.
+inline bool add_symbols(SymbolDatabase& sdb,
+                        const char* filename,
+                        const EmbeddedDatabase& embedded) {
+	if (SymbolJournal(filename).load(sdb))
+		return true;
+
+	return sdb.add_embedded(embedded);
+}
+
 int compare_command(int argc, char** argv) {
 	if (argc != 2) {
 		cerr << "compare commands needs exactly two arguments\n";
@@ -39,10 +65,8 @@ int compare_command(int argc, char** argv) {
 	auto sec = teximg_to_matrix(argv[1]);
 
 	SymbolDatabase sdb;
-	if (access(GENERATED_SYMBOLS_DB_FILE, F_OK) == 0)
-		sdb.add_from_file(GENERATED_SYMBOLS_DB_FILE);
-	if (access(MANUAL_SYMBOLS_DB_FILE, F_OK) == 0)
-		sdb.add_from_file(MANUAL_SYMBOLS_DB_FILE);
+	add_symbols(sdb, GENERATED_SYMBOLS_DB_FILE, EMBEDDED_GENERATED_SYMBOLS_DB);
+	add_symbols(sdb, MANUAL_SYMBOLS_DB_FILE, EMBEDDED_MANUAL_SYMBOLS_DB);
 
 	double diff = sdb.statistics().img_diff(fir, sec);
 	cerr << setprecision(6) << fixed << "\033[32;1m" << diff << "\033[m"
@@ -51,12 +75,143 @@ int compare_command(int argc, char** argv) {
 	return 0;
 }
 
-int gen_command(int argc, char**) {
-	if (argc > 0) {
-		cerr << "gen command takes no arguments\n";
+int db_compact_command(int argc, char** argv) {
+	double merge_tolerance = 0;
+	double confusable_margin = 0.5;
+	bool compaction_options = false;
+	vector<const char*> out_files;
+	// Parses the value of the option @p arg, e.g. "--margin=0.5"
+	auto parse_diff = [](std::string_view arg) {
+		auto value = arg.substr(arg.find('=') + 1);
+		std::istringstream iss {string(value)};
+		double diff;
+		if (value.empty() or not(iss >> diff) or not iss.eof())
+			throw std::runtime_error("Invalid option value: " + string(arg));
+
+		return diff;
+	};
+	for (int i = 0; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (has_prefix(arg, "--tolerance=")) {
+			merge_tolerance = parse_diff(arg);
+			compaction_options = true;
+		} else if (has_prefix(arg, "--margin=")) {
+			confusable_margin = parse_diff(arg);
+			compaction_options = true;
+		} else if (has_prefix(arg, "--")) {
+			cerr << "db-compact command: unknown option or option without "
+			        "a value: "
+			     << arg << '\n';
+			return 1;
+		} else {
+			out_files.emplace_back(argv[i]);
+		}
+	}
+
+	if (out_files.empty()) {
+		if (compaction_options) {
+			cerr << "db-compact command needs the output files to use "
+			        "--tolerance or --margin\n";
+			return 1;
+		}
+
+		size_t folded = SymbolJournal(MANUAL_SYMBOLS_DB_FILE).compact();
+		log_info("Folded ",
+		         folded,
+		         " journaled symbols into ",
+		         MANUAL_SYMBOLS_DB_FILE);
+		return 0;
+	}
+
+	if (out_files.size() != 2) {
+		cerr << "db-compact command needs no or exactly two output files\n";
 		return 1;
 	}
 
+	SymbolDatabase sdb;
+	if (not add_symbols(
+	       sdb, GENERATED_SYMBOLS_DB_FILE, EMBEDDED_GENERATED_SYMBOLS_DB)) {
+		cerr << "generated symbols database does not exist. Run \"gen\" "
+		        "command first\n";
+		return 1;
+	}
+	const size_t generated_symbols_num = sdb.symbols().size();
+	add_symbols(sdb, MANUAL_SYMBOLS_DB_FILE, EMBEDDED_MANUAL_SYMBOLS_DB);
+
+	auto compaction =
+	   compact_symbol_database(sdb, merge_tolerance, confusable_margin);
+	auto const& symbols = sdb.symbols();
+	for (auto const& pair : compaction.merged) {
+		log_info("Removed symbol ",
+		         pair.second,
+		         " (",
+		         symbols[pair.second].tex,
+		         ") as a duplicate of symbol ",
+		         pair.first,
+		         " with diff: ",
+		         setprecision(6),
+		         fixed,
+		         pair.diff);
+	}
+	for (auto const& pair : compaction.confusable) {
+		cout << symbols[pair.first].tex << '\t' << symbols[pair.second].tex
+		     << '\t' << setprecision(6) << fixed << pair.diff << '\n';
+	}
+	log_info("Removed ",
+	         compaction.merged.size(),
+	         " of ",
+	         symbols.size(),
+	         " symbols");
+
+	sdb.save_to_file(out_files[0], 0, generated_symbols_num, compaction.kept);
+	sdb.save_to_file(
+	   out_files[1], generated_symbols_num, symbols.size(), compaction.kept);
+	return 0;
+}
+
+// Writes the recorded trace events when destroyed, if tracing was requested
+class TraceWriter {
+	string filename_;
+
+public:
+	TraceWriter() = default;
+
+	TraceWriter(const TraceWriter&) = delete;
+	TraceWriter& operator=(const TraceWriter&) = delete;
+
+	~TraceWriter() {
+		if (filename_.empty())
+			return;
+
+		try {
+			Trace::write(filename_);
+		} catch (const std::exception& e) {
+			log_error("Error: ", e.what());
+		}
+	}
+
+	// Enables tracing if @p arg is --trace=<file>. Returns false iff. @p arg
+	// is not the tracing option.
+	bool parse_option(std::string_view arg) {
+		constexpr std::string_view prefix = "--trace=";
+		if (not has_prefix(arg, prefix))
+			return false;
+
+		filename_ = arg.substr(prefix.size());
+		Trace::enable();
+		return true;
+	}
+};
+
+int gen_command(int argc, char** argv) {
+	TraceWriter trace_writer;
+	for (int i = 0; i < argc; ++i) {
+		if (not trace_writer.parse_option(argv[i])) {
+			cerr << "gen command takes no arguments other than --trace\n";
+			return 1;
+		}
+	}
+
 	SymbolDatabase sdb;
 	sdb.generate_symbols();
 	sdb.save_to_file(GENERATED_SYMBOLS_DB_FILE);
@@ -86,11 +241,304 @@ int learn_command(int argc, char** argv) {
 	if (not tex.empty() and tex.back() == '\n')
 		tex.pop_back();
 
-	SymbolDatabase sdb;
-	if (access(MANUAL_SYMBOLS_DB_FILE, F_OK) == 0)
-		sdb.add_from_file(MANUAL_SYMBOLS_DB_FILE);
-	sdb.add_symbol_and_append_file(
-	   SymbolDatabase::text_img_to_symbol(symbol), tex, MANUAL_SYMBOLS_DB_FILE);
+	SymbolJournal journal(MANUAL_SYMBOLS_DB_FILE);
+	if (not journal.append(SymbolDatabase::text_img_to_symbol(symbol), tex))
+		log_info("The symbols database already contains this symbol");
+
+	return 0;
+}
+
+int merge_command(int argc, char** argv) {
+	optional<string> output_file;
+	vector<string> inputs;
+	for (int i = 0; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (has_prefix(arg, "--output="))
+			output_file = arg.substr(strlen("--output="));
+		else
+			inputs.emplace_back(arg);
+	}
+
+	if (inputs.empty()) {
+		cerr << "merge command needs at least one file\n";
+		return 1;
+	}
+
+	optional<UntexStats> stats;
+	vector<std::pair<string, string>> results; // (image name, result line)
+	for (auto const& input : inputs) {
+		// The stats are written last, so the results are complete
+		auto input_stats = UntexStats::read(input + ".stats");
+		if (stats)
+			stats->merge(input_stats);
+		else
+			stats = std::move(input_stats);
+
+		ifstream file(input);
+		if (not file.is_open())
+			throw std::runtime_error("Failed to open " + input);
+
+		for (string line; getline(file, line);) {
+			string name = line.substr(0, line.find('\t'));
+			results.emplace_back(std::move(name), std::move(line));
+		}
+	}
+
+	// Sharding does not keep the order of the images
+	std::stable_sort(results.begin(), results.end(), [](auto& a, auto& b) {
+		return a.first < b.first;
+	});
+	{
+		ofstream output;
+		if (output_file)
+			output.open(*output_file + ".tmp");
+		std::ostream& out = (output_file ? output : cout);
+		for (auto const& result : results)
+			out << result.second << '\n';
+		out.flush();
+		if (output_file and
+		    (not output or rename((*output_file + ".tmp").c_str(),
+		                          output_file->c_str()) != 0)) {
+			throw std::runtime_error("Failed to write " + *output_file);
+		}
+	}
+	if (output_file)
+		stats->write(*output_file + ".stats");
+
+	log_info("Merged ",
+	         stats->shards.size(),
+	         " of ",
+	         stats->shards_num,
+	         " shards: ",
+	         stats->images,
+	         " images, ",
+	         stats->untexed,
+	         " untexed, ",
+	         stats->failed,
+	         " failed, ",
+	         stats->unreadable,
+	         " unreadable in ",
+	         setprecision(1),
+	         fixed,
+	         stats->seconds,
+	         " s");
+	if (stats->verified > 0) {
+		log_info("Mean confidence of ",
+		         stats->verified,
+		         " verified results: ",
+		         setprecision(4),
+		         fixed,
+		         stats->confidence_sum / stats->verified);
+	}
+
+	auto missing = stats->missing_shards();
+	if (not missing.empty()) {
+		std::ostringstream list;
+		for (uint32_t shard : missing)
+			list << ' ' << shard << '/' << stats->shards_num;
+		log_warning("Missing shards:", list.str());
+		return 1;
+	}
+
+	return 0;
+}
+
+// Parses comma-separated numbers, e.g. "1.2,1.4"
+template <class T>
+vector<T> parse_list(std::string_view list) {
+	vector<T> res;
+	std::string_view str = list;
+	for (;;) {
+		auto comma = str.find(',');
+		std::istringstream iss(string(str.substr(0, comma)));
+		T x;
+		if (not(iss >> x) or not iss.eof())
+			throw std::runtime_error("Invalid number list: " + string(list));
+
+		res.emplace_back(x);
+		if (comma == str.npos)
+			return res;
+
+		str.remove_prefix(comma + 1);
+	}
+}
+
+// Identifies the symbols and images that matches are recorded for
+inline uint64_t sweep_cache_key(const SymbolDatabase& sdb,
+                                Segmentation segmentation,
+                                const vector<const char*>& png_files) {
+	uint64_t key = static_cast<uint64_t>(segmentation);
+	auto add = [&](uint64_t x) { key = key * 1000003 ^ x; };
+	for (auto const& symbol : sdb.symbols()) {
+		add(std::hash<Matrix<int>>()(symbol.img));
+		add(std::hash<string>()(symbol.tex));
+	}
+	for (const char* png_file : png_files) {
+		add(std::hash<std::string_view>()(png_file));
+		add(std::filesystem::file_size(png_file));
+		add(std::filesystem::last_write_time(png_file)
+		       .time_since_epoch()
+		       .count());
+	}
+
+	return key;
+}
+
+int sweep_command(int argc, char** argv) {
+	string cache_file = "sweep.cache";
+	vector<double> match_thresholds = {
+	   0.6, 0.8, 1.0, 1.2, 1.4, 1.6, 1.8, 2.0};
+	vector<int> size_thresholds = {2, 3, 4, 5, 6};
+	auto segmentation = Segmentation::EMPTY_COLUMNS;
+	TraceWriter trace_writer;
+	vector<const char*> args;
+	for (int i = 0; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (trace_writer.parse_option(arg))
+			continue;
+		if (has_prefix(arg, "--cache="))
+			cache_file = arg.substr(strlen("--cache="));
+		else if (has_prefix(arg, "--match="))
+			match_thresholds =
+			   parse_list<double>(arg.substr(strlen("--match=")));
+		else if (has_prefix(arg, "--size="))
+			size_thresholds = parse_list<int>(arg.substr(strlen("--size=")));
+		else if (arg == "--components")
+			segmentation = Segmentation::CONNECTED_COMPONENTS;
+		else
+			args.emplace_back(argv[i]);
+	}
+
+	if (args.size() < 2) {
+		cerr << "sweep command needs a directory and at least one image\n";
+		return 1;
+	}
+
+	const std::filesystem::path expected_dir = args[0];
+	const vector<const char*> png_files(args.begin() + 1, args.end());
+
+	SymbolDatabase symbol_db;
+	if (not add_symbols(symbol_db,
+	                    GENERATED_SYMBOLS_DB_FILE,
+	                    EMBEDDED_GENERATED_SYMBOLS_DB)) {
+		cerr << "generated symbols database does not exist. Run \"gen\" "
+		        "command first\n";
+		return 1;
+	}
+	add_symbols(symbol_db, MANUAL_SYMBOLS_DB_FILE, EMBEDDED_MANUAL_SYMBOLS_DB);
+
+	vector<MatchThresholds> settings;
+	MatchThresholds max_thresholds {0, 0};
+	for (double match : match_thresholds) {
+		for (int size_diff : size_thresholds) {
+			settings.push_back({match, size_diff});
+			max_thresholds.match = max(max_thresholds.match, match);
+			max_thresholds.size_diff = max(max_thresholds.size_diff, size_diff);
+		}
+	}
+
+	// Expected results are read first, so that a missing one is reported
+	// before the long recording
+	vector<string> expected(png_files.size());
+	for (size_t i = 0; i < png_files.size(); ++i) {
+		auto tex_file = expected_dir /
+		                std::filesystem::path(png_files[i]).filename();
+		tex_file.replace_extension(".tex");
+		ifstream file(tex_file);
+		if (not file.good())
+			throw std::runtime_error("Failed to open " + tex_file.string());
+
+		getline(file, expected[i], '\0');
+		while (not expected[i].empty() and expected[i].back() == '\n')
+			expected[i].pop_back();
+	}
+
+	auto decode = [&](size_t i) {
+		TraceScope trace("decode", "sweep", "file", i);
+		auto img = teximg_to_matrix(png_files[i]);
+		if (img.rows() * img.cols() == 0)
+			throw std::runtime_error("Cannot read image " +
+			                         string(png_files[i]));
+
+		return img;
+	};
+
+	const uint64_t key = sweep_cache_key(symbol_db, segmentation, png_files);
+	auto cache_is_usable = [&](const SweepCache& cache) {
+		auto cached_max = cache.max_thresholds();
+		return cache.key() == key and cache.images() == png_files.size() and
+		       cached_max.match >= max_thresholds.match and
+		       cached_max.size_diff >= max_thresholds.size_diff;
+	};
+	optional<SweepCache> cache;
+	if (access(cache_file.c_str(), F_OK) == 0) {
+		try {
+			cache.emplace(cache_file);
+			if (not cache_is_usable(*cache)) {
+				log_info("Cached matches do not fit, recording them again");
+				cache.reset();
+			}
+		} catch (const std::exception& e) {
+			log_warning(e.what(), ", recording matches again");
+		}
+	}
+
+	if (not cache) {
+		auto start = std::chrono::steady_clock::now();
+		vector<RecordedMatches> recorded(png_files.size());
+		thread_pool().parallel_for(0, png_files.size(), [&](size_t i) {
+			auto img = decode(i);
+			TraceScope trace("record", "sweep", "file", i);
+			recorded[i] =
+			   record_matches(img, symbol_db, segmentation, max_thresholds);
+		});
+		SweepCache::write(cache_file, key, max_thresholds, recorded);
+		log_info("Recorded matches in ",
+		         setprecision(3),
+		         fixed,
+		         std::chrono::duration<double>(
+		            std::chrono::steady_clock::now() - start)
+		            .count(),
+		         " s");
+		cache.emplace(cache_file);
+	}
+
+	auto start = std::chrono::steady_clock::now();
+	// correct[i] is the number of images untexed correctly with settings[i]
+	auto correct = thread_pool().parallel_reduce(
+	   0, png_files.size(), vector<size_t>(settings.size()),
+	   [&](vector<size_t>& correct, size_t i) {
+		   auto img = decode(i);
+		   TraceScope trace("replay", "sweep", "file", i);
+		   auto results = replay_untex(
+		      img, symbol_db, segmentation, cache->image(i), settings);
+		   for (size_t j = 0; j < settings.size(); ++j) {
+			   auto* tex = std::get_if<string>(&results[j]);
+			   correct[j] += (tex and *tex == expected[i]);
+		   }
+	   },
+	   [](vector<size_t> a, const vector<size_t>& b) {
+		   for (size_t j = 0; j < a.size(); ++j)
+			   a[j] += b[j];
+		   return a;
+	   });
+	log_info("Replayed ",
+	         settings.size(),
+	         " settings in ",
+	         setprecision(3),
+	         fixed,
+	         std::chrono::duration<double>(std::chrono::steady_clock::now() -
+	                                       start)
+	            .count(),
+	         " s");
+
+	cout << "match\tsize\tcorrect\taccuracy\n";
+	for (size_t j = 0; j < settings.size(); ++j) {
+		cout << setprecision(3) << fixed << settings[j].match << '\t'
+		     << settings[j].size_diff << '\t' << correct[j] << '/'
+		     << png_files.size() << '\t' << setprecision(2)
+		     << 100.0 * correct[j] / png_files.size() << "%\n";
+	}
 
 	return 0;
 }
@@ -117,58 +565,239 @@ int tex_command(int argc, char** argv) {
 	return 0;
 }
 
+// Prints unmatched candidates and optionally saves them to files numbered
+// from @p next_candidate_no
+inline void report_untex_failure(const UntexFailure& failure,
+                                 bool save_candidates,
+                                 int& next_candidate_no) {
+	log_warning("\033[1;31mCannot match any of the candidates:\033[m");
+	for (auto& candidate : failure.unmatched_symbol_candidates) {
+		if (save_candidates) {
+			auto fsym_file = failed_symbol_file(next_candidate_no++);
+			ofstream(fsym_file)
+			   << SymbolDatabase::symbol_to_text_img(candidate.img);
+			log_warning("Candidate saved to file ", fsym_file, ':');
+		}
+		log_warning(candidate.img);
+	}
+}
+
 int untex_command(int argc, char** argv) {
 	bool save_candidates = false;
-	if (argc == 2 and strcmp(argv[1], "--save-candidates") == 0) {
-		--argc;
-		save_candidates = true;
+	bool verify = false;
+	bool use_vp_tree = false;
+	bool watch = false;
+	auto segmentation = Segmentation::EMPTY_COLUMNS;
+	optional<Shard> shard;
+	optional<string> output_file;
+	TraceWriter trace_writer;
+	vector<const char*> png_files;
+	for (int i = 0; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (trace_writer.parse_option(arg))
+			continue;
+		if (has_prefix(arg, "--shard="))
+			shard = Shard::parse(arg.substr(strlen("--shard=")));
+		else if (has_prefix(arg, "--output="))
+			output_file = arg.substr(strlen("--output="));
+		else if (strcmp(argv[i], "--save-candidates") == 0)
+			save_candidates = true;
+		else if (strcmp(argv[i], "--verify") == 0)
+			verify = true;
+		else if (strcmp(argv[i], "--components") == 0)
+			segmentation = Segmentation::CONNECTED_COMPONENTS;
+		else if (strcmp(argv[i], "--vp-tree") == 0)
+			use_vp_tree = true;
+		else if (strcmp(argv[i], "--watch") == 0)
+			watch = true;
+		else
+			png_files.emplace_back(argv[i]);
 	}
 
-	if (argc != 1) {
+	if (png_files.empty()) {
 		cerr << "untex command needs an argument\n";
 		return 1;
 	}
 
-	const char* png_file = argv[0];
+	// Every image is untexed with one snapshot of the database (and its
+	// VP-tree), with --watch the newest one
+	optional<SymbolDatabaseWatcher> watcher;
+	std::shared_ptr<const SymbolDatabaseWatcher::Snapshot> symbols;
+	if (watch) {
+		if (access(GENERATED_SYMBOLS_DB_FILE, F_OK) != 0) {
+			cerr << "generated symbols database does not exist. Run \"gen\" "
+			        "command first\n";
+			return 1;
+		}
+		watcher.emplace(
+		   vector<string> {GENERATED_SYMBOLS_DB_FILE, MANUAL_SYMBOLS_DB_FILE},
+		   use_vp_tree);
+		symbols = watcher->snapshot();
+	} else {
+		auto sdb = std::make_shared<SymbolDatabase>();
+		if (not add_symbols(*sdb,
+		                    GENERATED_SYMBOLS_DB_FILE,
+		                    EMBEDDED_GENERATED_SYMBOLS_DB)) {
+			cerr << "generated symbols database does not exist. Run \"gen\" "
+			        "command first\n";
+			return 1;
+		}
+		add_symbols(*sdb, MANUAL_SYMBOLS_DB_FILE, EMBEDDED_MANUAL_SYMBOLS_DB);
+		auto snapshot = std::make_shared<SymbolDatabaseWatcher::Snapshot>();
+		snapshot->db = std::move(sdb);
+		if (use_vp_tree)
+			snapshot->vp_tree = std::make_shared<SymbolVpTree>(*snapshot->db);
+		symbols = std::move(snapshot);
+	}
 
-	if (access(GENERATED_SYMBOLS_DB_FILE, F_OK) != 0) {
-		cerr << "generated symbols database does not exist. Run \"gen\" "
-		        "command first\n";
-		return 1;
+	// The verifier keeps comparing with the statistics of the first snapshot
+	const auto verifier_db = symbols->db;
+	optional<RoundTripVerifier> verifier;
+	if (verify)
+		verifier.emplace(verifier_db->statistics());
+
+	// Results are written to a temporary file renamed once all are written,
+	// so a shard that did not finish leaves no output to merge
+	ofstream output;
+	if (output_file) {
+		output.open(*output_file + ".tmp");
+		if (not output.is_open())
+			throw std::runtime_error("Failed to open " + *output_file + ".tmp");
+	}
+	std::ostream& out = (output_file ? output : cout);
+	UntexStats stats(shard.value_or(Shard {}));
+	const auto start_time = std::chrono::steady_clock::now();
+
+	struct UntexedImg {
+		string png_file;
+		string tex;
+		std::future<double> confidence; // valid only if verifying
+	};
+	// Results are printed in order; the verified ones once their
+	// verification is done, so untexing of the next images does not wait
+	deque<UntexedImg> unprinted;
+	// With "-" file names are read from stdin until its end, so one process
+	// can serve many requests
+	const bool from_stdin =
+	   (png_files.size() == 1 and strcmp(png_files[0], "-") == 0);
+	// Sharded results have to be merged by the names
+	const bool print_names =
+	   (png_files.size() > 1 or from_stdin or shard or output_file);
+	auto print = [&](UntexedImg& untexed) {
+		std::ostringstream confidence;
+		if (untexed.confidence.valid()) {
+			try {
+				double value = untexed.confidence.get();
+				confidence << '\t' << setprecision(4) << fixed << value;
+				++stats.verified;
+				stats.confidence_sum += value;
+			} catch (const std::exception& e) {
+				confidence << "\tunverified";
+				log_warning(
+				   "Failed to verify ", untexed.png_file, ": ", e.what());
+			}
+		}
+
+		if (print_names)
+			out << untexed.png_file << '\t';
+		out << untexed.tex << confidence.str();
+		// Results are flushed one by one only to the interactive output
+		if (output_file)
+			out << '\n';
+		else
+			out << endl;
+	};
+	auto print_ready = [&](bool wait) {
+		while (not unprinted.empty()) {
+			auto& confidence = unprinted.front().confidence;
+			if (not wait and confidence.valid() and
+			    confidence.wait_for(std::chrono::seconds(0)) !=
+			       std::future_status::ready) {
+				return;
+			}
+
+			print(unprinted.front());
+			unprinted.pop_front();
+		}
+	};
+
+	int res = 0;
+	int next_candidate_no = 0;
+	string png_file;
+	for (size_t file_no = 0;; ++file_no) {
+		if (from_stdin) {
+			if (not getline(cin, png_file))
+				break;
+		} else if (file_no < png_files.size()) {
+			png_file = png_files[file_no];
+		} else {
+			break;
+		}
+
+		if (shard and not shard->contains(png_file))
+			continue;
+
+		++stats.images;
+		if (watcher)
+			symbols = watcher->snapshot();
+
+		Matrix<int> img = [&] {
+			TraceScope trace("decode", "untex", "file", file_no);
+			return teximg_to_matrix(png_file.c_str());
+		}();
+		if (img.rows() * img.cols() == 0) {
+			log_error("Cannot read image ", png_file);
+			++stats.unreadable;
+			res = 1;
+			continue;
+		}
+
+		auto untexed = [&] {
+			TraceScope trace("untex", "untex", "file", file_no);
+			return untex_img(
+			   img, *symbols->db, segmentation, symbols->vp_tree.get());
+		}();
+		std::visit(
+		   overloaded {
+		      [&](string tex) {
+			      std::future<double> confidence;
+			      if (verifier)
+				      confidence = verifier->verify(tex, std::move(img));
+			      unprinted.push_back(
+			         {png_file, std::move(tex), std::move(confidence)});
+			      ++stats.untexed;
+		      },
+		      [&](UntexFailure failure) {
+			      report_untex_failure(
+			         failure, save_candidates, next_candidate_no);
+			      ++stats.failed;
+			      res = 1;
+		      }},
+		   std::move(untexed));
+		print_ready(false);
 	}
 
-	SymbolDatabase symbol_db;
-	if (access(GENERATED_SYMBOLS_DB_FILE, F_OK) == 0)
-		symbol_db.add_from_file(GENERATED_SYMBOLS_DB_FILE);
-	if (access(MANUAL_SYMBOLS_DB_FILE, F_OK) == 0)
-		symbol_db.add_from_file(MANUAL_SYMBOLS_DB_FILE);
-
-	Matrix<int> img = teximg_to_matrix(png_file);
-	if (img.rows() * img.cols() == 0) {
-		cerr << "Cannot read image\n";
-		return 1;
+	print_ready(true);
+	stats.seconds = std::chrono::duration<double>(
+	                   std::chrono::steady_clock::now() - start_time)
+	                   .count();
+	if (output_file) {
+		output.close();
+		if (not output or rename((*output_file + ".tmp").c_str(),
+		                         output_file->c_str()) != 0) {
+			throw std::runtime_error("Failed to write " + *output_file);
+		}
+		stats.write(*output_file + ".stats");
+	}
+
+	if (auto const& vp_tree = symbols->vp_tree) {
+		log_info("VP-tree: compared with ",
+		         vp_tree->visited(),
+		         " symbols in ",
+		         vp_tree->searches(),
+		         " searches, the linear scan would compare with ",
+		         vp_tree->linear_scan_visited());
 	}
 
-	return std::visit(
-	   overloaded {
-	      [](string tex) {
-		      cout << tex << '\n';
-		      return 0;
-	      },
-	      [&](UntexFailure failure) {
-		      cerr << "\033[1;31mCannot match any of the candidates:\033[m\n";
-		      int next_candidate_no = 0;
-		      for (auto& candidate : failure.unmatched_symbol_candidates) {
-			      if (save_candidates) {
-				      auto fsym_file = failed_symbol_file(next_candidate_no++);
-				      ofstream(fsym_file)
-				         << SymbolDatabase::symbol_to_text_img(candidate.img);
-				      cerr << "Candidate saved to file " << fsym_file << ":\n";
-			      }
-			      binshow_matrix(candidate.img);
-		      }
-
-		      return 1;
-	      }},
-	   untex_img(img, symbol_db, true));
+	return res;
 }
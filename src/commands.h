@@ -2,10 +2,16 @@
 
 int compare_command(int argc, char** argv);
 
+int db_compact_command(int argc, char** argv);
+
 int gen_command(int argc, char** argv);
 
 int learn_command(int argc, char** argv);
 
+int merge_command(int argc, char** argv);
+
+int sweep_command(int argc, char** argv);
+
 int tex_command(int argc, char** argv);
 
 int untex_command(int argc, char** argv);
@@ -3,12 +3,43 @@
 #include "dsu.h"
 #include "matrix.h"
 
+#include <algorithm>
 #include <iomanip>
 #include <iostream>
+#include <vector>
 
+// Labels 8-connected components of non-zero fields. Every row is turned into
+// runs of consecutive non-zero fields, runs touching runs of the previous row
+// are joined, so the work is proportional to the number of runs rather than
+// fields (apart from reading the matrix). Components are numbered from 0 in
+// the order of their first field in row-major order.
 class Components {
+public:
+	struct Box {
+		int top, bottom, left, right; // inclusive
+
+		int rows() const noexcept { return bottom - top + 1; }
+
+		int cols() const noexcept { return right - left + 1; }
+
+		void extend(const Box& other) noexcept {
+			top = std::min(top, other.top);
+			bottom = std::max(bottom, other.bottom);
+			left = std::min(left, other.left);
+			right = std::max(right, other.right);
+		}
+	};
+
+private:
+	struct Run {
+		int row;
+		int beg, end; // [beg, end)
+		int label;
+	};
+
 	Matrix<int> cid_; // For each field keep the number of component it is in
-	int components_ = 0;
+	std::vector<Box> boxes_;
+	std::vector<int> sizes_;
 
 public:
 	explicit Components(const SubmatrixView<int>& mat)
@@ -17,65 +48,64 @@ public:
 	Components(const SubmatrixView<int>& mat, int rows, int cols)
 	   : cid_(rows, cols) {
 		cid_.fill(-1);
+		rows = std::min(rows, mat.rows());
+		cols = std::min(cols, mat.cols());
 
 		DSU dsu(0);
+		std::vector<Run> runs;
+		size_t prev_row_beg = 0; // first run of the previous row
 		for (int i = 0; i < rows; ++i) {
-			for (int j = 0; j < cols; ++j) {
-				constexpr int di[] = {-1, -1, 0};
-				constexpr int dj[] = {0, -1, -1};
-				int last_joined = -1;
-				for (int k = 0; k < 3; ++k) {
-					int ii = i + di[k];
-					int jj = j + dj[k];
-					if (ii < 0 or jj < 0)
-						continue;
-
-					int x = cid_[ii][jj];
-					if (x != -1) {
-						if (last_joined != -1)
-							dsu.join(last_joined, x);
-
-						last_joined = x;
-						// to_join[to_join_size++] = cid_[ii][jj];
-					}
+			size_t curr_row_beg = runs.size();
+			// Runs of the previous row before it do not touch the next runs
+			size_t first_touching = prev_row_beg;
+			const int* row = mat[i];
+			for (int j = 0; j < cols;) {
+				if (not row[j]) {
+					++j;
+					continue;
+				}
+
+				int beg = j;
+				while (j < cols and row[j])
+					++j;
+
+				// Runs of the previous row touching [beg - 1, j] (diagonally
+				// adjacent fields are connected as well)
+				while (first_touching < curr_row_beg and
+				       runs[first_touching].end < beg) {
+					++first_touching;
 				}
 
-				// Join together everything found
-				// e.g. .x
-				//      y.
-				// x and y have to be joined together
-				// for (int k = 1; k < to_join_size; ++k)
-				// dsu.join(to_join[k - 1], to_join[k]);
-
-				if (mat[i][j]) {
-					// if (to_join_size > 0)
-					// cid_[i][j] = dsu.find(to_join[0]);
-					if (last_joined != -1)
-						cid_[i][j] = dsu.find(last_joined);
+				int label = -1;
+				for (size_t k = first_touching;
+				     k < curr_row_beg and runs[k].beg <= j;
+				     ++k) {
+					if (label == -1)
+						label = runs[k].label;
 					else
-						cid_[i][j] = dsu.add();
+						dsu.join(runs[k].label, label);
 				}
-			}
-		}
 
-		// vector<int> cids;
-		components_ = dsu.size();
+				runs.push_back({i, beg, j, (label == -1 ? dsu.add() : label)});
+			}
 
-		// Update cids to be valid without dsu.find
-		for (int i = 0; i < mat.rows(); ++i)
-			for (int j = 0; j < mat.cols(); ++j)
-				if (cid_[i][j] != -1)
-					cid_[i][j] = dsu.find(cid_[i][j]);
-		// cids.emplace_back(cid_[i][j] = dsu.find(cid_[i][j]));
+			prev_row_beg = curr_row_beg;
+		}
 
-		// sort(cids.begin(), cids.end());
-		// cids.erase(unique(cids.begin(), cids.end()), cids.end());
-		// components_ = cids.size();
+		// Number components in the order of their first run
+		std::vector<int> component_of_root(dsu.size(), -1);
+		for (auto& run : runs) {
+			int& cid = component_of_root[dsu.find(run.label)];
+			if (cid == -1) {
+				cid = boxes_.size();
+				boxes_.push_back({run.row, run.row, run.beg, run.end - 1});
+				sizes_.emplace_back(0);
+			}
 
-		// for (int i = 0; i < mat.rows(); ++i)
-		// 	for (int j = 0; j < mat.cols(); ++j)
-		// 		if (int& x = cid_[i][j]; x != -1)
-		// 			x = lower_bound(cids.begin(), cids.end(), x) - cids.begin();
+			boxes_[cid].extend({run.row, run.row, run.beg, run.end - 1});
+			sizes_[cid] += run.end - run.beg;
+			std::fill(cid_[run.row] + run.beg, cid_[run.row] + run.end, cid);
+		}
 	}
 
 	int rows() const noexcept { return cid_.rows(); }
@@ -84,7 +114,13 @@ public:
 
 	int component_id(int i, int j) const noexcept { return cid_[i][j]; }
 
-	int components() const noexcept { return components_; }
+	int components() const noexcept { return boxes_.size(); }
+
+	// Bounding box of the component @p cid
+	const Box& box(int cid) const noexcept { return boxes_[cid]; }
+
+	// Number of fields of the component @p cid
+	int size(int cid) const noexcept { return sizes_[cid]; }
 
 	void print() const {
 		for (int i = 0; i < rows(); ++i) {
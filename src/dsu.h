@@ -17,7 +17,21 @@ public:
 		return x;
 	}
 
-	int find(int x) noexcept { return (p[x] == x ? x : p[x] = find(p[x])); }
+	// Iterative, so that long chains do not overflow the stack
+	int find(int x) noexcept {
+		int root = x;
+		while (p[root] != root)
+			root = p[root];
+
+		// Path compression
+		while (p[x] != root) {
+			int next = p[x];
+			p[x] = root;
+			x = next;
+		}
+
+		return root;
+	}
 
 	void join(int a, int b) noexcept { p[find(a)] = find(b); }
 };
@@ -0,0 +1,97 @@
+#include "symbol_database.h"
+#include "symbol_journal.h"
+
+#include <iostream>
+
+using std::cerr;
+using std::cout;
+using std::string;
+using std::vector;
+
+// Writes C++ string literal representing @p str to cout
+static void write_string_literal(const string& str) {
+	cout << '"';
+	for (unsigned char c : str) {
+		if (c == '\\' or c == '"')
+			cout << '\\' << c;
+		else if (c >= ' ' and c < 127)
+			cout << c;
+		else
+			cout << '\\' << char('0' + (c >> 6)) << char('0' + (c >> 3 & 7))
+			     << char('0' + (c & 7));
+	}
+	cout << '"';
+}
+
+// Writes the definition of EmbeddedDatabase @p name with contents of the
+// database file @p filename and its journal (empty if neither exists). Helper
+// arrays are named with @p prefix.
+static void write_embedded_database(const char* name,
+                                    const char* prefix,
+                                    const char* filename) {
+	SymbolDatabase sdb;
+	SymbolJournal(filename).load(sdb);
+
+	auto const& symbols = sdb.symbols();
+	if (symbols.empty()) {
+		cout << "const EmbeddedDatabase " << name
+		     << " = {nullptr, 0, nullptr, {}};\n\n";
+		return;
+	}
+
+	cout << "static const EmbeddedSymbol " << prefix << "_symbols[] = {\n";
+	size_t bits = 0;
+	for (auto const& symbol : symbols) {
+		cout << "   {";
+		write_string_literal(symbol.tex);
+		cout << ", " << symbol.img.rows() << ", " << symbol.img.cols() << ", "
+		     << bits << "},\n";
+		bits += symbol.img.rows() * symbol.img.cols();
+	}
+	cout << "};\n\n";
+
+	vector<uint8_t> img_bits((bits + 7) >> 3);
+	bits = 0;
+	for (auto const& symbol : symbols) {
+		for (int i = 0; i < symbol.img.rows(); ++i) {
+			for (int j = 0; j < symbol.img.cols(); ++j, ++bits)
+				img_bits[bits >> 3] |= bool(symbol.img[i][j]) << (bits & 7);
+		}
+	}
+
+	cout << "static const uint8_t " << prefix << "_img_bits[] = {";
+	for (size_t i = 0; i < img_bits.size(); ++i)
+		cout << (i % 16 == 0 ? "\n   " : " ") << int(img_bits[i]) << ',';
+	cout << "\n};\n\n";
+
+	cout << "const EmbeddedDatabase " << name << " = {\n   " << prefix
+	     << "_symbols,\n   " << symbols.size() << ",\n   " << prefix
+	     << "_img_bits,\n   {";
+	auto const& counts = sdb.statistics().counts();
+	for (size_t i = 0; i < counts.size(); ++i)
+		cout << (i % 16 == 0 ? "\n      " : " ") << counts[i] << ',';
+	cout << "\n   },\n};\n\n";
+}
+
+// Writes C++ source defining databases embedded into the binary
+int main(int argc, char** argv) {
+	if (argc != 3) {
+		cerr << "Usage: " << argv[0]
+		     << " <generated_symbols_db_file> <manual_symbols_db_file>\n";
+		return 1;
+	}
+
+	try {
+		cout << "// Generated by embed_symbol_db, do not edit\n"
+		        "#include \"embedded_symbols.h\"\n\n";
+		write_embedded_database(
+		   "EMBEDDED_GENERATED_SYMBOLS_DB", "generated_symbols", argv[1]);
+		write_embedded_database(
+		   "EMBEDDED_MANUAL_SYMBOLS_DB", "manual_symbols", argv[2]);
+	} catch (const std::exception& e) {
+		cerr << "Error: " << e.what() << '\n';
+		return 1;
+	}
+
+	return 0;
+}
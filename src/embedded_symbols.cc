@@ -0,0 +1,7 @@
+#include "embedded_symbols.h"
+
+// Used when no database is embedded into the binary
+
+const EmbeddedDatabase EMBEDDED_GENERATED_SYMBOLS_DB = {
+   nullptr, 0, nullptr, {}};
+const EmbeddedDatabase EMBEDDED_MANUAL_SYMBOLS_DB = {nullptr, 0, nullptr, {}};
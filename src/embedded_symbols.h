@@ -0,0 +1,27 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+
+struct EmbeddedSymbol {
+	const char* tex;
+	int rows;
+	int cols;
+	// Offset of the first bit of the image in EmbeddedDatabase::img_bits;
+	// pixels are stored row by row, the least significant bit of a byte first
+	size_t img_bits_offset;
+};
+
+// Symbol database compiled into the binary together with its statistics, so
+// that it can be loaded without any file I/O or parsing
+struct EmbeddedDatabase {
+	const EmbeddedSymbol* symbols;
+	size_t symbols_num;
+	const uint8_t* img_bits;
+	std::array<int, 1 << 9> statistics; // SymbolStatistics::counts()
+};
+
+// Both are empty unless the binary was built with the img2tex-embedded target
+extern const EmbeddedDatabase EMBEDDED_GENERATED_SYMBOLS_DB;
+extern const EmbeddedDatabase EMBEDDED_MANUAL_SYMBOLS_DB;
@@ -1,27 +1,99 @@
 #include "commands.h"
+#include "log.h"
+#include "string.h"
 
 #include <cstring>
 #include <iostream>
 
 using std::cerr;
 
+// Removes --log-level=<level> options from @p argv and sets the log level.
+// Returns the new argc.
+int parse_log_level(int argc, char** argv) {
+	constexpr std::string_view prefix = "--log-level=";
+	int new_argc = 0;
+	for (int i = 0; i < argc; ++i) {
+		std::string_view arg = argv[i];
+		if (not has_prefix(arg, prefix)) {
+			argv[new_argc++] = argv[i];
+			continue;
+		}
+
+		auto level = Log::parse_level(arg.substr(prefix.size()));
+		if (not level)
+			throw std::runtime_error("Invalid log level: " + std::string(arg));
+
+		Log::set_level(*level);
+	}
+
+	return new_argc;
+}
+
 int main2(int argc, char** argv) {
+	argc = parse_log_level(argc, argv);
 	if (argc < 2) {
-		cerr << "Usage: " << argv[0] << " <command> [arguments...]\n"
+		cerr << "Usage: " << argv[0]
+		     << " <command> [arguments...] [--log-level=<level>]\n"
 		     <<
 		   R"=(Available commands:\n"
   compare <png_file_1> <png_file_2>
                        Compares two png images as symbols
-  gen                  Generates symbols database to file symbols.db.
-  learn <symbol_file>  Reads symbol from symbol_file and saves it to the
-                         symbols database as tex formula that is read from
-                         input.
+  db-compact [--tolerance=<diff>] [--margin=<diff>] [<generated_db> <manual_db>]
+                       Removes from the symbols databases symbols that differ
+                         by at most --tolerance (default 0) from an earlier
+                         symbol with the same tex and writes the rest to the
+                         given files. Prints pairs of symbols with different
+                         tex that differ by at most --margin (default 0.5).
+                         Without the files, only folds the journal of learned
+                         symbols into manual_symbols.db.
+  gen [--trace=<file>] Generates symbols database to file symbols.db.
+  learn <symbol_file>  Reads symbol from symbol_file and appends it to the
+                         journal of manual_symbols.db as tex formula that is
+                         read from input. Safe to run concurrently.
+  merge [--output=<file>] <untex_output>...
+                       Merges outputs of untex runs with --output (e.g. on
+                         different shards) into one ordered by the file names
+                         and sums their statistics. Exits with code 1 if some
+                         shards are missing.
+  sweep [--match=<list>] [--size=<list>] [--cache=<file>] [--components]
+        <expected_dir> <png_file>...
+                       Untexes the png files with every combination of the
+                         comma-separated match thresholds and size difference
+                         thresholds and prints the fraction of results equal
+                         to <expected_dir>/<name>.tex for every combination.
+                         Image comparisons are done once and cached in the
+                         file (default sweep.cache) until the symbols, the
+                         images or the maximal thresholds change.
   tex <out_png_file>   Reads tex formula from input and writes PNG image
                          compiled from this formula to the out_png_file.
-  untex <png_file> [--save-candidates]
+  untex <png_file>... [--save-candidates] [--verify] [--components] [--vp-tree]
+        [--watch] [--shard=<i>/<n>] [--output=<file>] [--trace=<file>]
                        Tries to convert png_file to the source tex formula and
                          print the result to the output, otherwise exits with
-                         code 1.
+                         code 1. If many files (or "-" to read their names
+                         from input) are given, every result is preceded by
+                         the file name and a tab. --watch applies changes of
+                         the symbols databases (e.g. learned symbols) to the
+                         next images without a restart. --verify renders
+                         the results back in the background and appends a tab
+                         and the confidence (from 0 to 1) that the render
+                         matches the image. --components splits the image
+                         into symbols by connected components instead of by
+                         empty columns. --vp-tree searches the symbols
+                         database through a vantage-point tree instead of
+                         scanning it; it is approximate and prints how many
+                         symbols were compared with. --shard untexes only
+                         the files in the i-th (from 0) of n parts chosen by
+                         a hash of their names, so independent processes can
+                         split the work. --output writes the results to the
+                         file and the statistics of the run to <file>.stats
+                         once all are done, see merge. --trace writes a
+                         Chrome trace (see chrome://tracing or
+                         ui.perfetto.dev) of the run to the file; gen accepts
+                         it too.
+
+--log-level=<level> sets what is logged to stderr: error, warning, info
+(default) or debug (e.g. every matched symbol).
 )=";
 		return 1;
 	}
@@ -29,10 +101,16 @@ int main2(int argc, char** argv) {
 	const char* command = argv[1];
 	if (strcmp(command, "compare") == 0)
 		return compare_command(argc - 2, argv + 2);
+	if (strcmp(command, "db-compact") == 0)
+		return db_compact_command(argc - 2, argv + 2);
 	if (strcmp(command, "gen") == 0)
 		return gen_command(argc - 2, argv + 2);
 	if (strcmp(command, "learn") == 0)
 		return learn_command(argc - 2, argv + 2);
+	if (strcmp(command, "merge") == 0)
+		return merge_command(argc - 2, argv + 2);
+	if (strcmp(command, "sweep") == 0)
+		return sweep_command(argc - 2, argv + 2);
 	if (strcmp(command, "tex") == 0)
 		return tex_command(argc - 2, argv + 2);
 	if (strcmp(command, "untex") == 0)
@@ -44,8 +122,11 @@ int main2(int argc, char** argv) {
 
 int main(int argc, char** argv) {
 	try {
-		return main2(argc, argv);
+		int res = main2(argc, argv);
+		Log::flush();
+		return res;
 	} catch (const std::exception& e) {
+		Log::flush();
 		cerr << "Error: " << e.what() << '\n';
 		return 1;
 	}
@@ -1,20 +1,22 @@
 #include "improve_tex.h"
+#include "log.h"
 #include "string.h"
 #include "utilities.h"
 
 #include <iostream>
-#include <regex>
+#include <vector>
 
-using std::regex;
-using std::regex_replace;
 using std::reverse;
 using std::string;
+using std::string_view;
 using std::vector;
 
-static string space_digits_into_3digit_groups(const string& tex) {
+static string space_digits_into_3digit_groups(string_view tex) {
 	string res;
+	// Every group of 3 digits may add "\\," (2 characters)
+	res.reserve(tex.size() + (tex.size() * 2 + 2) / 3);
 	auto parse = [&](size_t beg, size_t end) {
-		auto no_spacing = [&] { res.append(tex, beg, end - beg); };
+		auto no_spacing = [&] { res.append(tex.substr(beg, end - beg)); };
 		if (end - beg < 5)
 			return no_spacing();
 
@@ -32,7 +34,7 @@ static string space_digits_into_3digit_groups(const string& tex) {
 		}
 
 		// Start grouping from the right
-		int pos_mod_to_add_space_before = end % 3;
+		size_t pos_mod_to_add_space_before = end % 3;
 		res += tex[beg];
 		while (++beg < end) {
 			if (beg % 3 == pos_mod_to_add_space_before)
@@ -59,43 +61,54 @@ static string space_digits_into_3digit_groups(const string& tex) {
 	return res;
 }
 
-static string separate_indexes_from_symbols(const string& tex) {
-	return regex_replace(tex, regex(R"#((\{\})?(\^|_))#"), " $2");
-}
-
 namespace {
 
-constexpr bool debug = false;
-
 class LatexParser {
 	string tex_;
 	vector<int> matching_bracket_pos_;
 
 public:
-	LatexParser(const string& tex)
-	   : tex_(separate_indexes_from_symbols(tex)),
-	     matching_bracket_pos_(tex_.size(), -1) {
-		fill_matching_bracket_pos();
+	explicit LatexParser(string_view tex) {
+		separate_indexes_from_symbols_and_match_brackets(tex);
 
-		if constexpr (debug)
-			std::cerr << tex_ << '\n';
+		log_trace(tex_);
 	}
 
 	LatexParser(const LatexParser&) = delete;
 	LatexParser& operator=(const LatexParser&) = delete;
 
 private:
-	void fill_matching_bracket_pos() {
+	// Replaces every "{}^", "{}_", "^" and "_" with " ^" or " _" respectively
+	// and matches brackets of the result, all in one pass over @p tex
+	void separate_indexes_from_symbols_and_match_brackets(string_view tex) {
+		tex_.reserve(tex.size() * 2);
+		matching_bracket_pos_.reserve(tex.size() * 2);
 		vector<int> pos_stack;
-		for (size_t i = 0; i < tex_.size(); ++i) {
-			if (tex_[i] == '{') {
-				pos_stack.emplace_back(i);
-			} else if (tex_[i] == '}') {
+
+		auto append = [&](char c) {
+			int pos = tex_.size();
+			tex_ += c;
+			matching_bracket_pos_.emplace_back(-1);
+			if (c == '{') {
+				pos_stack.emplace_back(pos);
+			} else if (c == '}' and not pos_stack.empty()) {
 				int j = pos_stack.back();
 				pos_stack.pop_back();
-				matching_bracket_pos_[i] = j;
-				matching_bracket_pos_[j] = i;
+				matching_bracket_pos_[pos] = j;
+				matching_bracket_pos_[j] = pos;
 			}
+		};
+
+		for (size_t i = 0; i < tex.size(); ++i) {
+			if (has_prefix(tex.substr(i), "{}") and i + 2 < tex.size() and
+			    is_one_of(tex[i + 2], '^', '_')) {
+				i += 2;
+			}
+
+			if (is_one_of(tex[i], '^', '_'))
+				append(' ');
+
+			append(tex[i]);
 		}
 	}
 
@@ -113,10 +126,11 @@ private:
 			return (not top_index.empty() or not bottom_index.empty());
 		}
 
-		string to_tex() const {
-			string res = symbol;
-			if (res.empty() and has_index())
-				res = "{}";
+		void append_tex_to(string& res) const {
+			if (symbol.empty() and has_index())
+				res += "{}";
+			else
+				res += symbol;
 
 			for (const string& arg : arguments)
 				res.append({'{'}).append(arg).append({'}'});
@@ -139,7 +153,11 @@ private:
 				res += '^';
 				append_index(top_index);
 			}
+		}
 
+		string to_tex() const {
+			string res;
+			append_tex_to(res);
 			return res;
 		}
 	};
@@ -194,7 +212,10 @@ private:
 
 		auto end_of_symbol = [&] {
 			// Two or more symbols in index requires re-parsing e.g. a_1 {}_0,
-			// gives a_{1 0}, which after re-parsing gives a_{10}
+			// gives a_{1 0}, which after re-parsing gives a_{10}. The
+			// re-parse splits the index tex into symbols anew (x_{ab} {}_c
+			// gives x_{abc}, as "ab" becomes a and b), so it is part of what
+			// the output is and cannot be folded into the enclosing pass.
 
 			if (top_index_symbols > 1) {
 				auto& idx = symbols.back().top_index;
@@ -247,7 +268,7 @@ private:
 				if (not index_tex.empty())
 					index_tex += ' ';
 
-				index_tex += parse_symbol().to_tex();
+				parse_symbol().append_tex_to(index_tex);
 				++index_symbols;
 				continue;
 			}
@@ -258,11 +279,18 @@ private:
 
 		end_of_symbol();
 
-		if constexpr (debug) {
-			std::cerr << "[" << beg << ", " << end << ") + " << ignore_blanks
-			          << ": '" << tex_.substr(beg, end - beg) << "'\n";
+		if (Log::enabled<LogLevel::TRACE>()) {
+			log_trace('[',
+			          beg,
+			          ", ",
+			          end,
+			          ") + ",
+			          ignore_blanks,
+			          ": '",
+			          tex_.substr(beg, end - beg),
+			          '\'');
 			for (auto& symbol : symbols)
-				std::cerr << '\'' << symbol.to_tex() << "'\n";
+				log_trace('\'', symbol.to_tex(), '\'');
 		}
 
 		return convert_symbols_to_string(symbols);
@@ -348,6 +376,7 @@ private:
 		   };
 
 		string res;
+		res.reserve(symbols.size() * 4);
 		for (Symbol const& symbol : symbols) {
 			// Need to use | instead of || because all functions have to be
 			// called as they update their state for each symbol
@@ -363,7 +392,7 @@ private:
 			if (remove_last_space and not res.empty())
 				res.pop_back();
 
-			res += symbol.to_tex();
+			symbol.append_tex_to(res);
 			res += ' ';
 		}
 
@@ -376,6 +405,6 @@ private:
 
 } // namespace
 
-string improve_tex(const string& tex) {
+string improve_tex(string_view tex) {
 	return space_digits_into_3digit_groups(LatexParser(tex).parse());
 }
@@ -1,5 +1,6 @@
 #pragma once
 
 #include <string>
+#include <string_view>
 
-std::string improve_tex(const std::string& symbols);
+std::string improve_tex(std::string_view tex);
@@ -0,0 +1,189 @@
+#pragma once
+
+#include "matrix.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <string>
+#include <string_view>
+#include <thread>
+
+enum class LogLevel {
+	ERROR,
+	WARNING,
+	INFO, // default
+	DEBUG, // e.g. every matched symbol
+	TRACE, // e.g. every candidate, compiled in only with IMG2TEX_TRACE_LOGS
+};
+
+#ifdef IMG2TEX_TRACE_LOGS
+constexpr LogLevel MAX_LOG_LEVEL = LogLevel::TRACE;
+#else
+constexpr LogLevel MAX_LOG_LEVEL = LogLevel::DEBUG;
+#endif
+
+// Messages are formatted by the logging threads and written to stderr by a
+// background thread, so logging threads never wait for the terminal. Messages
+// above the runtime level are not formatted at all, and messages above
+// MAX_LOG_LEVEL are removed at compile time.
+class Log {
+	inline static std::atomic<LogLevel> level_ = LogLevel::INFO;
+
+	std::mutex lock_;
+	std::condition_variable changed_;
+	std::deque<std::string> queue_;
+	bool writing_ = false; // true iff the writer holds messages not yet written
+	bool stop_ = false;
+	std::thread writer_;
+
+	Log() : writer_([this] { write_messages(); }) {}
+
+	~Log() {
+		{
+			std::lock_guard<std::mutex> guard(lock_);
+			stop_ = true;
+		}
+		changed_.notify_all();
+		writer_.join();
+	}
+
+	static Log& instance() {
+		static Log log;
+		return log;
+	}
+
+	void write_messages() {
+		std::deque<std::string> messages;
+		std::unique_lock<std::mutex> lock(lock_);
+		for (;;) {
+			changed_.wait(lock, [&] { return stop_ or not queue_.empty(); });
+			if (queue_.empty())
+				return; // stop_ is set and everything is written
+
+			messages.swap(queue_);
+			writing_ = true;
+			lock.unlock();
+			for (auto const& message : messages)
+				fwrite(message.data(), 1, message.size(), stderr);
+			fflush(stderr);
+			messages.clear();
+			lock.lock();
+			writing_ = false;
+			changed_.notify_all();
+		}
+	}
+
+public:
+	static LogLevel level() noexcept {
+		return level_.load(std::memory_order_relaxed);
+	}
+
+	static void set_level(LogLevel level) noexcept { level_ = level; }
+
+	// Returns the level named @p name (e.g. "debug") or nothing
+	static std::optional<LogLevel> parse_level(std::string_view name) noexcept {
+		constexpr std::pair<std::string_view, LogLevel> levels[] = {
+		   {"error", LogLevel::ERROR},
+		   {"warning", LogLevel::WARNING},
+		   {"info", LogLevel::INFO},
+		   {"debug", LogLevel::DEBUG},
+		   {"trace", LogLevel::TRACE},
+		};
+		for (auto [level_name, level] : levels) {
+			if (name == level_name)
+				return level;
+		}
+
+		return std::nullopt;
+	}
+
+	template <LogLevel LEVEL>
+	static bool enabled() noexcept {
+		if constexpr (LEVEL > MAX_LOG_LEVEL)
+			return false;
+		else
+			return LEVEL <= level();
+	}
+
+	// Queues @p message to be written followed by '\n'
+	static void write(std::string message) {
+		message += '\n';
+		auto& log = instance();
+		{
+			std::lock_guard<std::mutex> guard(log.lock_);
+			log.queue_.emplace_back(std::move(message));
+		}
+		log.changed_.notify_all();
+	}
+
+	// Waits until all queued messages are written, should be called before
+	// writing to stderr directly
+	static void flush() {
+		auto& log = instance();
+		std::unique_lock<std::mutex> lock(log.lock_);
+		log.changed_.wait(
+		   lock, [&] { return log.queue_.empty() and not log.writing_; });
+	}
+};
+
+namespace detail {
+
+template <class T>
+void format_log_arg(std::ostream& os, const T& arg) {
+	os << arg;
+}
+
+// Images are drawn like binshow_matrix() does
+template <class T>
+void format_log_arg(std::ostream& os, const Matrix<T>& img) {
+	os << img.rows() << ' ' << img.cols();
+	for (int i = 0; i < img.rows(); ++i) {
+		os << '\n';
+		for (int j = 0; j < img.cols(); ++j)
+			os << (img[i][j] ? '#' : ' ');
+	}
+}
+
+} // namespace detail
+
+// Writes the concatenation of @p args as one message if LEVEL is enabled;
+// otherwise @p args are not even formatted
+template <LogLevel LEVEL, class... Args>
+void write_log(const Args&... args) {
+	if (not Log::enabled<LEVEL>())
+		return;
+
+	std::ostringstream os;
+	(detail::format_log_arg(os, args), ...);
+	Log::write(os.str());
+}
+
+template <class... Args>
+void log_error(const Args&... args) {
+	write_log<LogLevel::ERROR>(args...);
+}
+
+template <class... Args>
+void log_warning(const Args&... args) {
+	write_log<LogLevel::WARNING>(args...);
+}
+
+template <class... Args>
+void log_info(const Args&... args) {
+	write_log<LogLevel::INFO>(args...);
+}
+
+template <class... Args>
+void log_debug(const Args&... args) {
+	write_log<LogLevel::DEBUG>(args...);
+}
+
+template <class... Args>
+void log_trace(const Args&... args) {
+	write_log<LogLevel::TRACE>(args...);
+}
@@ -1,8 +1,31 @@
 #pragma once
 
+#include <algorithm>
 #include <cassert>
+#include <cstddef>
+#include <functional>
 #include <vector>
 
+// Contiguous range of elements of a matrix row
+template <class T>
+class RowSpan {
+	T* data_;
+	int size_;
+
+public:
+	RowSpan(T* data, int size) noexcept : data_(data), size_(size) {}
+
+	T* data() const noexcept { return data_; }
+
+	int size() const noexcept { return size_; }
+
+	T& operator[](int i) const noexcept { return data_[i]; }
+
+	T* begin() const noexcept { return data_; }
+
+	T* end() const noexcept { return data_ + size_; }
+};
+
 template <class T = int>
 class Matrix {
 	int n, m;
@@ -54,6 +77,10 @@ public:
 
 	const T* operator[](int i) const noexcept { return data.data() + m * i; }
 
+	RowSpan<T> row(int i) noexcept { return {(*this)[i], m}; }
+
+	RowSpan<const T> row(int i) const noexcept { return {(*this)[i], m}; }
+
 	auto begin() noexcept { return data.begin(); }
 
 	auto begin() const noexcept { return data.begin(); }
@@ -243,12 +270,13 @@ public:
 	                   other.cols_) {}
 
 	Matrix<T> resized(int rows, int cols) const {
-		Matrix res(rows, cols);
+		Matrix<T> res(rows, cols);
 		int rend = std::min(rows_, rows);
 		int cend = std::min(cols_, cols);
-		for (int r = 0; r < rend; ++r)
-			for (int c = 0; c < cend; ++c)
-				res[r][c] = (*this)[r][c];
+		for (int r = 0; r < rend; ++r) {
+			const U* src = (*this)[r];
+			std::copy(src, src + cend, res[r]);
+		}
 
 		return res;
 	}
@@ -267,6 +295,8 @@ public:
 		return mat_[beg_row_ + i] + beg_col_;
 	}
 
+	RowSpan<const U> row(int i) const noexcept { return {(*this)[i], cols_}; }
+
 	template <class Type>
 	class Iterator {
 	public:
@@ -351,3 +381,18 @@ public:
 
 template <class T, class... Args>
 SubmatrixView(const Matrix<T>& mat, Args&&...)->SubmatrixView<T, T>;
+
+namespace std {
+
+template <class T>
+struct hash<Matrix<T>> {
+	size_t operator()(const Matrix<T>& mat) const noexcept {
+		size_t res = hash<int>()(mat.rows()) * 1000003 ^ mat.cols();
+		for (auto const& x : mat)
+			res = res * 1000003 ^ hash<T>()(x);
+
+		return res;
+	}
+};
+
+} // namespace std
@@ -1,6 +1,7 @@
 #pragma once
 
 #include "matrix.h"
+#include "padded_matrix.h"
 
 template <class T, class U>
 T sum3x3(const SubmatrixView<T, U>& mat, int r, int c) {
@@ -20,6 +21,22 @@ T sum3x3(const Matrix<T>& mat, int r, int c) {
 	return sum3x3(SubmatrixView(mat), r, c);
 }
 
+// Guard cells are summed instead of skipping the cells outside of @p mat,
+// so it has to be ensured that they are zero
+template <class T, int BORDER>
+T sum3x3(const PaddedMatrix<T, BORDER>& mat, int r, int c) {
+	static_assert(BORDER >= 1);
+	T sum = T();
+	for (int i = r - 1; i <= r + 1; ++i) {
+		const T* row = mat[i] + c;
+		sum += row[-1];
+		sum += row[0];
+		sum += row[1];
+	}
+
+	return sum;
+}
+
 template <class T, class U>
 int size3x3(const SubmatrixView<T, U>& mat, int r, int c) {
 	int rbeg = std::max(r - 1, 0);
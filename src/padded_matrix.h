@@ -0,0 +1,118 @@
+#pragma once
+
+#include "matrix.h"
+
+#include <algorithm>
+#include <memory>
+#include <new>
+#include <type_traits>
+
+// Matrix surrounded on every side by BORDER rows / columns of guard cells.
+// Guard cells are zero unless written to, so neighbourhood kernels may read up
+// to BORDER cells past the edges without bounds checks. The first element of
+// every row is aligned to ALIGNMENT bytes and rows are ALIGNMENT bytes apart,
+// which lets the compiler vectorize row loops.
+template <class T, int BORDER = 1>
+class PaddedMatrix {
+	static_assert(std::is_arithmetic_v<T>);
+	static_assert(BORDER >= 0);
+
+	static constexpr size_t ALIGNMENT = 64;
+	static constexpr int ALIGNED_ELEMS = ALIGNMENT / sizeof(T);
+
+	static constexpr int round_up(int x) noexcept {
+		return (x + ALIGNED_ELEMS - 1) / ALIGNED_ELEMS * ALIGNED_ELEMS;
+	}
+
+	// Number of elements before the first element of a row
+	static constexpr int LEFT_PADDING = round_up(BORDER);
+
+	struct AlignedDeleter {
+		void operator()(T* ptr) const noexcept {
+			::operator delete[](ptr, std::align_val_t(ALIGNMENT));
+		}
+	};
+
+	int n, m;
+	int stride_; // distance between consecutive rows (in elements)
+	size_t size_; // number of allocated elements
+	std::unique_ptr<T[], AlignedDeleter> data_;
+
+	T* row_ptr(int i) const noexcept {
+		return data_.get() + (i + BORDER) * stride_ + LEFT_PADDING;
+	}
+
+public:
+	static constexpr int border = BORDER;
+
+	PaddedMatrix(int rows, int cols)
+	   : n(rows), m(cols), stride_(round_up(LEFT_PADDING + cols + BORDER)),
+	     size_(size_t(rows + 2 * BORDER) * stride_),
+	     data_(static_cast<T*>(::operator new[](
+	        size_ * sizeof(T), std::align_val_t(ALIGNMENT)))) {
+		clear();
+	}
+
+	template <class U>
+	explicit PaddedMatrix(const SubmatrixView<T, U>& mat)
+	   : PaddedMatrix(mat.rows(), mat.cols()) {
+		for (int i = 0; i < n; ++i) {
+			auto src = mat.row(i);
+			std::copy(src.begin(), src.end(), row_ptr(i));
+		}
+	}
+
+	template <class U>
+	explicit PaddedMatrix(const Matrix<U>& mat)
+	   : PaddedMatrix(SubmatrixView<T, U>(mat)) {}
+
+	PaddedMatrix(const PaddedMatrix& other)
+	   : PaddedMatrix(other.n, other.m) {
+		std::copy(other.data_.get(), other.data_.get() + size_, data_.get());
+	}
+
+	PaddedMatrix(PaddedMatrix&&) noexcept = default;
+	PaddedMatrix& operator=(PaddedMatrix&&) noexcept = default;
+
+	PaddedMatrix& operator=(const PaddedMatrix& other) {
+		return *this = PaddedMatrix(other);
+	}
+
+	int rows() const noexcept { return n; }
+
+	int cols() const noexcept { return m; }
+
+	int stride() const noexcept { return stride_; }
+
+	// Valid for i \in [-BORDER, rows + BORDER) and the returned pointer may
+	// be indexed with j \in [-BORDER, cols + BORDER)
+	T* operator[](int i) noexcept { return row_ptr(i); }
+
+	const T* operator[](int i) const noexcept { return row_ptr(i); }
+
+	RowSpan<T> row(int i) noexcept { return {row_ptr(i), m}; }
+
+	RowSpan<const T> row(int i) const noexcept { return {row_ptr(i), m}; }
+
+	// Fills the matrix without the guard cells
+	PaddedMatrix& fill(T val) noexcept {
+		for (int i = 0; i < n; ++i)
+			std::fill(row_ptr(i), row_ptr(i) + m, val);
+
+		return *this;
+	}
+
+	// Zeroes the whole matrix together with the guard cells
+	PaddedMatrix& clear() noexcept {
+		std::fill(data_.get(), data_.get() + size_, T());
+		return *this;
+	}
+
+	Matrix<T> to_matrix() const {
+		Matrix<T> res(n, m);
+		for (int i = 0; i < n; ++i)
+			std::copy(row_ptr(i), row_ptr(i) + m, res[i]);
+
+		return res;
+	}
+};
@@ -0,0 +1,53 @@
+#pragma once
+
+#include "symbol_img_utils.h"
+#include "symbol_statistics.h"
+#include "thread_pool.h"
+#include "trace.h"
+
+#include <string>
+
+// Verifies untexed formulas by rendering them back to images and comparing
+// the renders with the original images. Rendering spends most of the time in
+// external processes (latex, dvips, pstoimg), so it is done by a separate,
+// small pool of workers that never takes threads used for matching.
+class RoundTripVerifier {
+	const SymbolStatistics& stats_;
+	ThreadPool render_pool_;
+
+public:
+	static constexpr unsigned DEFAULT_RENDER_WORKERS = 2;
+
+	explicit RoundTripVerifier(const SymbolStatistics& stats,
+	                           unsigned render_workers = DEFAULT_RENDER_WORKERS)
+	   : stats_(stats), render_pool_(render_workers) {}
+
+	// Returns 1 / (1 + d) where d is img_diff() of @p img and @p rendered
+	// (without empty borders) per filled pixel of @p img, so 1 means that the
+	// images are identical and the confidence drops as they differ
+	static double confidence(const SymbolStatistics& stats,
+	                         const Matrix<int>& img,
+	                         const Matrix<int>& rendered) {
+		auto fir = without_empty_borders(img).symbol;
+		auto sec = without_empty_borders(rendered).symbol;
+		int filled = 0;
+		for (int r = 0; r < fir.rows(); ++r)
+			for (int c = 0; c < fir.cols(); ++c)
+				filled += bool(fir[r][c]);
+
+		double diff = stats.img_diff(fir, sec);
+		return 1 / (1 + diff / std::max(filled, 1));
+	}
+
+	// Schedules rendering of @p tex and comparing it with @p img and returns
+	// immediately. The future holds confidence() or the exception thrown if
+	// rendering failed. Verifications not started before the verifier is
+	// destroyed are abandoned.
+	std::future<double> verify(std::string tex, Matrix<int> img) {
+		return render_pool_.submit(
+		   [this, tex = std::move(tex), img = std::move(img)] {
+			   TraceScope trace("verify", "verify");
+			   return confidence(stats_, img, tex_to_img_matrix(tex));
+		   });
+	}
+};
@@ -1,6 +1,9 @@
 #pragma once
 
+#include "trace.h"
+
 #include <cstring>
+#include <fcntl.h>
 #include <stdexcept>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -8,15 +11,19 @@
 // Returns true iff the command was executed and exited successfully
 template <class... Args>
 bool run_command(bool quiet, const std::string& cmd, Args&&... args) {
+	TraceScope trace(cmd, "process");
 	pid_t pid = fork();
 	if (pid < 0)
 		throw std::runtime_error(std::string("fork() - ") + strerror(errno));
 
 	if (pid == 0) {
 		close(STDIN_FILENO);
+		// Only file descriptors are redirected: freopen() would flush the
+		// stdio buffers inherited from the parent and duplicate its output
 		if (quiet) {
-			freopen("/dev/null", "w", stdout);
-			freopen("/dev/null", "w", stderr);
+			int fd = open("/dev/null", O_WRONLY);
+			dup2(fd, STDOUT_FILENO);
+			dup2(fd, STDERR_FILENO);
 		}
 
 		execlp(
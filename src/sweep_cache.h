@@ -0,0 +1,169 @@
+#pragma once
+
+#include "untex_img.h"
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <vector>
+
+// Matches recorded by record_matches() for a list of images, stored in a file
+// that is memory-mapped when read, so replaying neither parses nor copies it.
+// The file is a cache for one machine, so numbers are stored in its native
+// byte order. Layout:
+//   Header
+//   ImageEntry[images]
+//   uint32_t begins[] -- begins of all images, each followed by its end
+//   RecordedMatch matches[] -- aligned to 8 bytes
+class SweepCache {
+	static constexpr char MAGIC[8] = {'I', 'M', 'G', '2', 'T', 'E', 'X', 'S'};
+	static constexpr uint32_t VERSION = 1;
+
+	struct Header {
+		char magic[8];
+		uint32_t version;
+		uint32_t images;
+		uint64_t key;
+		double max_match_threshold;
+		int32_t max_size_diff;
+		uint32_t padding;
+		uint64_t begins_num;
+		uint64_t matches_num;
+	};
+
+	struct ImageEntry {
+		uint64_t begins_offset; // index of the first begin of the image
+		uint64_t matches_offset; // index of the first match of the image
+		uint64_t pairs;
+	};
+
+	void* data_ = nullptr;
+	size_t size_ = 0;
+	const Header* header_ = nullptr;
+	const ImageEntry* images_ = nullptr;
+	const uint32_t* begins_ = nullptr;
+	const RecordedMatch* matches_ = nullptr;
+
+	static size_t matches_offset(size_t images, size_t begins_num) noexcept {
+		size_t offset = sizeof(Header) + images * sizeof(ImageEntry) +
+		                begins_num * sizeof(uint32_t);
+		return (offset + 7) / 8 * 8;
+	}
+
+public:
+	// Maps @p filename; throws if it is not a valid cache file
+	explicit SweepCache(const std::string& filename) {
+		int fd = open(filename.c_str(), O_RDONLY);
+		if (fd < 0)
+			throw std::runtime_error("Failed to open " + filename);
+
+		struct stat st;
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			throw std::runtime_error("Failed to stat " + filename);
+		}
+
+		size_ = st.st_size;
+		if (size_ >= sizeof(Header))
+			data_ = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+		close(fd);
+		if (data_ == MAP_FAILED or data_ == nullptr) {
+			data_ = nullptr;
+			throw std::runtime_error("Failed to map " + filename);
+		}
+
+		auto* bytes = static_cast<const char*>(data_);
+		header_ = reinterpret_cast<const Header*>(bytes);
+		if (memcmp(header_->magic, MAGIC, sizeof(MAGIC)) != 0 or
+		    header_->version != VERSION or
+		    size_ != matches_offset(header_->images, header_->begins_num) +
+		                header_->matches_num * sizeof(RecordedMatch)) {
+			munmap(data_, size_);
+			data_ = nullptr;
+			throw std::runtime_error(filename + " is not a valid sweep cache");
+		}
+
+		images_ = reinterpret_cast<const ImageEntry*>(bytes + sizeof(Header));
+		begins_ = reinterpret_cast<const uint32_t*>(images_ + header_->images);
+		matches_ = reinterpret_cast<const RecordedMatch*>(
+		   bytes + matches_offset(header_->images, header_->begins_num));
+	}
+
+	SweepCache(const SweepCache&) = delete;
+	SweepCache& operator=(const SweepCache&) = delete;
+
+	~SweepCache() {
+		if (data_)
+			munmap(data_, size_);
+	}
+
+	// Identifies the database and the images the matches were recorded for
+	uint64_t key() const noexcept { return header_->key; }
+
+	MatchThresholds max_thresholds() const noexcept {
+		return {header_->max_match_threshold, header_->max_size_diff};
+	}
+
+	size_t images() const noexcept { return header_->images; }
+
+	RecordedMatchesView image(size_t i) const noexcept {
+		return {begins_ + images_[i].begins_offset,
+		        images_[i].pairs,
+		        matches_ + images_[i].matches_offset};
+	}
+
+	static void write(const std::string& filename,
+	                  uint64_t key,
+	                  MatchThresholds max_thresholds,
+	                  const std::vector<RecordedMatches>& images) {
+		Header header {};
+		memcpy(header.magic, MAGIC, sizeof(MAGIC));
+		header.version = VERSION;
+		header.images = images.size();
+		header.key = key;
+		header.max_match_threshold = max_thresholds.match;
+		header.max_size_diff = max_thresholds.size_diff;
+
+		std::vector<ImageEntry> entries;
+		for (auto const& img : images) {
+			entries.push_back(
+			   {header.begins_num, header.matches_num, img.begins.size() - 1});
+			header.begins_num += img.begins.size();
+			header.matches_num += img.matches.size();
+		}
+
+		FILE* file = fopen(filename.c_str(), "wb");
+		if (not file)
+			throw std::runtime_error("Failed to open " + filename);
+
+		fwrite(&header, sizeof(header), 1, file);
+		fwrite(entries.data(), sizeof(ImageEntry), entries.size(), file);
+		for (auto const& img : images)
+			fwrite(img.begins.data(), sizeof(uint32_t), img.begins.size(), file);
+
+		size_t offset = sizeof(Header) + entries.size() * sizeof(ImageEntry) +
+		                header.begins_num * sizeof(uint32_t);
+		const char zeros[8] = {};
+		fwrite(zeros,
+		       1,
+		       matches_offset(header.images, header.begins_num) - offset,
+		       file);
+		for (auto const& img : images) {
+			fwrite(img.matches.data(),
+			       sizeof(RecordedMatch),
+			       img.matches.size(),
+			       file);
+		}
+
+		bool failed = ferror(file);
+		failed |= (fclose(file) != 0);
+		if (failed)
+			throw std::runtime_error("Failed to write " + filename);
+	}
+};
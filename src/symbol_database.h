@@ -1,12 +1,22 @@
 #pragma once
 
-#include "job_queue.h"
+#include "embedded_symbols.h"
 #include "string.h"
 #include "symbol_img_utils.h"
 #include "symbol_statistics.h"
+#include "thread_pool.h"
+#include "trace.h"
 
+#include <cctype>
+#include <charconv>
 #include <fstream>
-#include <thread>
+#include <limits>
+#include <numeric>
+#include <optional>
+#include <string_view>
+#include <tuple>
+#include <type_traits>
+#include <unordered_map>
 
 enum class SymbolKind {
 	INDEX, // upper or lower index like {}_x or {}^x
@@ -24,15 +34,111 @@ struct Symbol {
 	   : img(std::move(i)), tex(std::move(t)), kind(k) {}
 };
 
+// Images of the database symbols as SymbolStatistics::to_row_bits() of them,
+// stored in one contiguous array ordered by (rows, cols, index of the symbol),
+// with the other per-image data in parallel arrays. Scanning the symbols of
+// a similar size reads a single range of memory sequentially instead of
+// chasing a heap-allocated Matrix per symbol.
+class SymbolArena {
+public:
+	using RowBits = SymbolStatistics::RowBits;
+	// Offset of an image that does not fit in RowBits
+	static constexpr uint32_t NO_BITS = std::numeric_limits<uint32_t>::max();
+
+private:
+	std::vector<int> rows_, cols_;
+	std::vector<uint32_t> offsets_; // of the first row of the image in bits_
+	std::vector<uint32_t> ids_; // index of the symbol in symbols()
+	std::vector<RowBits> bits_;
+
+public:
+	SymbolArena() = default;
+
+	explicit SymbolArena(const std::vector<Symbol>& symbols) {
+		std::vector<uint32_t> order(symbols.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::sort(order.begin(), order.end(), [&](uint32_t a, uint32_t b) {
+			auto const& x = symbols[a].img;
+			auto const& y = symbols[b].img;
+			return std::tuple(x.rows(), x.cols(), a) <
+			       std::tuple(y.rows(), y.cols(), b);
+		});
+
+		rows_.reserve(order.size());
+		cols_.reserve(order.size());
+		offsets_.reserve(order.size());
+		ids_ = std::move(order);
+		std::vector<RowBits> img_bits;
+		for (uint32_t id : ids_) {
+			auto const& img = symbols[id].img;
+			rows_.emplace_back(img.rows());
+			cols_.emplace_back(img.cols());
+			if (SymbolStatistics::to_row_bits(img, img_bits)) {
+				offsets_.emplace_back(bits_.size());
+				bits_.insert(bits_.end(), img_bits.begin(), img_bits.end());
+			} else {
+				offsets_.emplace_back(NO_BITS);
+			}
+		}
+	}
+
+	size_t size() const noexcept { return ids_.size(); }
+
+	int rows(size_t i) const noexcept { return rows_[i]; }
+
+	int cols(size_t i) const noexcept { return cols_[i]; }
+
+	size_t symbol_id(size_t i) const noexcept { return ids_[i]; }
+
+	// Returns nullptr if the i-th image does not fit in RowBits
+	const RowBits* bits(size_t i) const noexcept {
+		return offsets_[i] == NO_BITS ? nullptr : bits_.data() + offsets_[i];
+	}
+
+	// Returns [beg, end) of the images with rows in [min_rows, max_rows]
+	std::pair<size_t, size_t> rows_range(int min_rows,
+	                                     int max_rows) const noexcept {
+		return {
+		   std::lower_bound(rows_.begin(), rows_.end(), min_rows) -
+		      rows_.begin(),
+		   std::upper_bound(rows_.begin(), rows_.end(), max_rows) -
+		      rows_.begin()};
+	}
+};
+
 class SymbolDatabase {
 	std::vector<Symbol> symbols_;
 	SymbolStatistics stats_;
+	// Hash of the symbol image => index of the symbol in symbols_
+	std::unordered_multimap<size_t, size_t> symbol_ids_by_img_hash_;
+	// Rebuilt after every batch of added symbols
+	SymbolArena arena_;
 
 	static void write_symbol(std::ofstream& file,
 	                         const Matrix<int>& symbol,
 	                         const std::string& tex_formula) {
-		file << tex_formula.size() << ' ' << tex_formula << ' ' << symbol.rows()
-		     << ' ' << symbol.cols() << ' ';
+		file << encode_symbol(symbol, tex_formula);
+	}
+
+	static SymbolKind tex_to_symbol_kind(const std::string& tex) noexcept {
+		if (has_prefix(tex, Symbol::INDEX_PREFIX))
+			return SymbolKind::INDEX;
+
+		return SymbolKind::OTHER;
+	}
+
+public:
+	// Returns the record of the symbol as stored in the database file
+	static std::string encode_symbol(const Matrix<int>& symbol,
+	                                 const std::string& tex_formula) {
+		std::string res = std::to_string(tex_formula.size());
+		res += ' ';
+		res += tex_formula;
+		res += ' ';
+		res += std::to_string(symbol.rows());
+		res += ' ';
+		res += std::to_string(symbol.cols());
+		res += ' ';
 
 		int rows = symbol.rows();
 		int cols = symbol.cols();
@@ -43,7 +149,7 @@ class SymbolDatabase {
 			for (int j = 0; j < cols; ++j) {
 				dt |= (symbol[i][j] << k++);
 				if (k == 4) {
-					file << digits[dt];
+					res += digits[dt];
 					dt = 0;
 					k = 0;
 				}
@@ -51,65 +157,125 @@ class SymbolDatabase {
 		}
 
 		if (k > 0)
-			file << digits[dt];
-
-		file << '\n';
-	}
-
-	static SymbolKind tex_to_symbol_kind(const std::string& tex) noexcept {
-		if (has_prefix(tex, Symbol::INDEX_PREFIX))
-			return SymbolKind::INDEX;
+			res += digits[dt];
 
-		return SymbolKind::OTHER;
+		res += '\n';
+		return res;
 	}
 
-	static Symbol read_symbol(std::ifstream& file) {
-		int k;
-		file >> k;
-		if (file.get() != ' ')
-			throw std::runtime_error("Read invalid symbol");
-
-		std::string tex(k, ' ');
-		file.read(tex.data(), k);
-		if (file.gcount() != k)
-			throw std::runtime_error("Reading symbol error");
-
+	// Symbol as stored in the database file
+	struct SymbolRecord {
+		std::string_view tex;
 		int rows, cols;
-		file >> rows >> cols;
+		std::string_view img_data; // hex digits of the image
+	};
+
+	// Splits @p contents of the database file into records without decoding
+	// the images. Records are delimited by their lengths, not by '\n', as tex
+	// may contain it.
+	static std::vector<SymbolRecord> split_records(std::string_view contents) {
+		std::vector<SymbolRecord> res;
+		size_t pos = 0;
+		auto skip_whitespace = [&] {
+			while (pos < contents.size() and
+			       std::isspace((unsigned char)contents[pos]))
+				++pos;
+		};
+		auto read_int = [&] {
+			skip_whitespace();
+			int x;
+			auto [ptr, ec] = std::from_chars(
+			   contents.data() + pos, contents.data() + contents.size(), x);
+			if (ec != std::errc())
+				throw std::runtime_error("Read invalid symbol");
+
+			pos = ptr - contents.data();
+			return x;
+		};
+		auto read_space = [&] {
+			if (pos >= contents.size() or contents[pos++] != ' ')
+				throw std::runtime_error("Read invalid symbol");
+		};
+		auto read_bytes = [&](size_t len) {
+			if (contents.size() - pos < len)
+				throw std::runtime_error("Reading symbol error");
 
-		if (file.get() != ' ')
-			throw std::runtime_error("Read invalid symbol");
+			auto bytes = contents.substr(pos, len);
+			pos += len;
+			return bytes;
+		};
 
-		std::string data((rows * cols + 3) >> 2, '\0');
-		file.read(data.data(), data.size());
-		if (file.gcount() != (std::streamsize)data.size())
-			throw std::runtime_error("Reading symbol error");
+		while (pos < contents.size()) {
+			SymbolRecord rec;
+			int k = read_int();
+			read_space();
+			rec.tex = read_bytes(k);
+			rec.rows = read_int();
+			rec.cols = read_int();
+			read_space();
+			rec.img_data = read_bytes((rec.rows * rec.cols + 3) >> 2);
+			res.emplace_back(rec);
+			++pos; // '\n'
+		}
 
-		Matrix<int> mat(rows, cols);
-		k = 0;
-		auto hex_digit_to_int = [](int c) {
-			return (c >= 'a' ? c - 'a' + 10 : c - '0');
-		};
-		for (int i = 0; i < rows; ++i) {
-			for (int j = 0; j < cols; ++j) {
-				mat[i][j] = (hex_digit_to_int(data[k >> 2]) >> (k & 3)) & 1;
-				++k;
+		return res;
+	}
+
+private:
+	static Matrix<int> decode_symbol_img(const SymbolRecord& rec) {
+		// nibble_pixels[digit] are the 4 pixels encoded by the hex digit
+		static constexpr auto nibble_pixels = [] {
+			std::array<std::array<int, 4>, 256> res {};
+			for (int i = 0; i < 256; ++i) {
+				int c = static_cast<char>(i);
+				int val = (c >= 'a' ? c - 'a' + 10 : c - '0');
+				for (int k = 0; k < 4; ++k)
+					res[i][k] = (val >> k) & 1;
 			}
-		}
+			return res;
+		}();
+
+		Matrix<int> mat(rec.rows, rec.cols);
+		if (rec.rows == 0)
+			return mat;
+
+		// Pixels are encoded row by row, so they can be decoded as one array
+		int* pixels = mat[0];
+		size_t size = size_t(rec.rows) * rec.cols;
+		auto decode_digit = [&](size_t k, size_t len) {
+			unsigned char digit = rec.img_data[k >> 2];
+			std::copy_n(nibble_pixels[digit].begin(), len, pixels + k);
+		};
+		size_t k = 0;
+		for (; k + 4 <= size; k += 4)
+			decode_digit(k, 4);
+		if (k < size)
+			decode_digit(k, size - k);
 
-		return {mat, tex, tex_to_symbol_kind(tex)};
+		return mat;
 	}
 
 	void update_statistics(const Matrix<int>& symbol) {
-		for (int i = 0; i < symbol.rows(); ++i)
-			for (int j = 0; j < symbol.cols(); ++j)
-				stats_.increment(SymbolStatistics::mask(symbol, i, j));
+		auto masks = SymbolStatistics::mask_image(symbol);
+		for (int i = 1; i <= symbol.rows(); ++i)
+			for (int j = 1; j <= symbol.cols(); ++j)
+				stats_.increment(masks[i][j]);
+	}
+
+	// Adds @p symbol without updating statistics
+	void index_symbol(Symbol symbol) {
+		symbol_ids_by_img_hash_.emplace(std::hash<Matrix<int>>()(symbol.img),
+		                                symbols_.size());
+		symbols_.emplace_back(std::move(symbol));
+	}
+
+	void add_symbol(Symbol symbol) {
+		update_statistics(symbol.img);
+		index_symbol(std::move(symbol));
 	}
 
 	void add_symbol(const Matrix<int>& symbol, const std::string& tex_formula) {
-		symbols_.emplace_back(
-		   symbol, tex_formula, tex_to_symbol_kind(tex_formula));
-		update_statistics(symbol);
+		add_symbol({symbol, tex_formula, tex_to_symbol_kind(tex_formula)});
 	}
 
 public:
@@ -118,16 +284,90 @@ public:
 	void clear() {
 		symbols_.clear();
 		stats_.reset();
+		symbol_ids_by_img_hash_.clear();
+		arena_ = SymbolArena();
 	}
 
-	void add_from_file(const std::string& filename) {
+	// Returns the contents of the file @p filename or nothing if it cannot be
+	// opened
+	static std::optional<std::string> read_file(const std::string& filename) {
 		std::ifstream file(filename, std::ios::binary);
-		while (file.get(), file) {
-			file.unget();
-			symbols_.emplace_back(read_symbol(file));
-			update_statistics(symbols_.back().img);
-			file.get(); // '\n'
+		if (not file.is_open())
+			return std::nullopt;
+
+		std::string contents;
+		file.seekg(0, std::ios::end);
+		contents.resize(std::max<std::streamoff>(file.tellg(), 0));
+		file.seekg(0);
+		file.read(contents.data(), contents.size());
+		if (file.gcount() != (std::streamsize)contents.size())
+			throw std::runtime_error("Reading symbol error");
+
+		return contents;
+	}
+
+	// Reads the whole file at once, see add_from_string()
+	void add_from_file(const std::string& filename) {
+		if (auto contents = read_file(filename))
+			add_from_string(*contents);
+	}
+
+	// Splits @p contents of a database file into records, see add_records()
+	void add_from_string(std::string_view contents) {
+		add_records(split_records(contents));
+	}
+
+	// Decodes @p records in parallel. The result is the same as adding the
+	// symbols one by one.
+	void add_records(const std::vector<SymbolRecord>& records) {
+		std::vector<Matrix<int>> images(records.size(), Matrix<int>(0, 0));
+		auto counts = thread_pool().parallel_reduce(
+		   0, records.size(), SymbolStatistics::Counts {},
+		   [&](SymbolStatistics::Counts& cnt, size_t i) {
+			   images[i] = decode_symbol_img(records[i]);
+			   SymbolStatistics::count_masks(images[i], cnt);
+		   },
+		   [](SymbolStatistics::Counts a, const SymbolStatistics::Counts& b) {
+			   for (size_t mask = 0; mask < a.size(); ++mask)
+				   a[mask] += b[mask];
+			   return a;
+		   });
+
+		symbols_.reserve(symbols_.size() + records.size());
+		for (size_t i = 0; i < records.size(); ++i) {
+			std::string tex(records[i].tex);
+			auto kind = tex_to_symbol_kind(tex);
+			index_symbol({std::move(images[i]), std::move(tex), kind});
 		}
+
+		stats_.add(counts);
+		arena_ = SymbolArena(symbols_);
+	}
+
+	// Returns false iff. @p db is empty
+	bool add_embedded(const EmbeddedDatabase& db) {
+		static_assert(
+		   std::is_same_v<decltype(db.statistics), SymbolStatistics::Counts>);
+		if (db.symbols_num == 0)
+			return false;
+
+		symbols_.reserve(symbols_.size() + db.symbols_num);
+		for (size_t i = 0; i < db.symbols_num; ++i) {
+			const EmbeddedSymbol& symbol = db.symbols[i];
+			Matrix<int> img(symbol.rows, symbol.cols);
+			size_t k = symbol.img_bits_offset;
+			for (int r = 0; r < symbol.rows; ++r) {
+				for (int c = 0; c < symbol.cols; ++c, ++k)
+					img[r][c] = (db.img_bits[k >> 3] >> (k & 7)) & 1;
+			}
+
+			index_symbol({std::move(img), symbol.tex,
+			              tex_to_symbol_kind(symbol.tex)});
+		}
+
+		stats_.add(db.statistics);
+		arena_ = SymbolArena(symbols_);
+		return true;
 	}
 
 	void save_to_file(const std::string& filename) const {
@@ -136,20 +376,37 @@ public:
 			write_symbol(file, symbol.img, symbol.tex);
 	}
 
+	// Saves only symbols with indexes (in symbols()) from [@p beg, @p end)
+	// for which @p keep is true
+	void save_to_file(const std::string& filename,
+	                  size_t beg,
+	                  size_t end,
+	                  const std::vector<bool>& keep) const {
+		std::ofstream file(filename, std::ios::binary);
+		for (size_t i = beg; i < end; ++i) {
+			if (keep[i])
+				write_symbol(file, symbols_[i].img, symbols_[i].tex);
+		}
+	}
+
 	const SymbolStatistics& statistics() const noexcept { return stats_; }
 
 	const decltype(symbols_)& symbols() const noexcept { return symbols_; }
 
-	void add_symbol_and_append_file(const Matrix<int>& symbol,
-	                                const std::string& tex_formula,
-	                                const std::string& filename) {
-		for (auto const& sym : symbols_)
-			if (sym.img == symbol)
-				return;
+	const SymbolArena& arena() const noexcept { return arena_; }
+
+	// Returns indexes (in symbols()) of the symbols with image equal to @p img
+	std::vector<size_t> identical_symbols(const Matrix<int>& img) const {
+		std::vector<size_t> res;
+		auto [beg, end] =
+		   symbol_ids_by_img_hash_.equal_range(std::hash<Matrix<int>>()(img));
+		for (auto it = beg; it != end; ++it) {
+			if (symbols_[it->second].img == img)
+				res.emplace_back(it->second);
+		}
 
-		std::ofstream file(filename, std::ios::binary | std::ios::app);
-		add_symbol(symbol, tex_formula);
-		write_symbol(file, symbol, tex_formula);
+		std::sort(res.begin(), res.end());
+		return res;
 	}
 
 	static Matrix<int> text_img_to_symbol(std::string text) {
@@ -196,7 +453,7 @@ public:
 	}
 
 private:
-	static void generate_tex_symbols(JobQueue<std::string>& job_queue) {
+	static std::vector<std::string> generate_tex_symbols() {
 		using std::string;
 		using std::vector;
 
@@ -369,6 +626,7 @@ private:
 		   "\\ast",
 		};
 
+		vector<string> res;
 		for (auto const* vec : {&greek_letters,
 		                        &small_latin,
 		                        &big_latin,
@@ -376,27 +634,27 @@ private:
 		                        &index_operators,
 		                        &other_operators}) {
 			for (string const& symbol : *vec)
-				job_queue.add_job(symbol);
+				res.emplace_back(symbol);
 		}
 
 		for (auto const* vec : {&greek_letters, &small_latin, &big_latin})
 			for (string const& symbol : *vec)
-				job_queue.add_job(symbol + "'");
+				res.emplace_back(symbol + "'");
 
 		for (auto const* vec : {&small_latin, &big_latin}) {
 			for (string const& letter : *vec) {
-				job_queue.add_job("\\textrm{" + letter + "}");
-				job_queue.add_job("\\texttt{" + letter + "}");
+				res.emplace_back("\\textrm{" + letter + "}");
+				res.emplace_back("\\texttt{" + letter + "}");
 			}
 		}
 
 		for (string const& d1 : digits)
 			for (string const& d2 : digits)
-				job_queue.add_job(d1 + "^" + d2);
+				res.emplace_back(d1 + "^" + d2);
 
 		for (string const& letter : small_latin)
 			for (string const& digit : digits)
-				job_queue.add_job(letter + "_" + digit);
+				res.emplace_back(letter + "_" + digit);
 
 		auto brace_for_index = [](const string& tex) {
 			return (tex.size() == 1 ? tex : "{" + tex + "}");
@@ -408,16 +666,17 @@ private:
 		                        &index_operators,
 		                        &greek_letters}) {
 			for (string const& symbol : *vec) {
-				job_queue.add_job(string(Symbol::INDEX_PREFIX) +
-				                  brace_for_index(symbol));
+				res.emplace_back(string(Symbol::INDEX_PREFIX) +
+				                 brace_for_index(symbol));
 			}
 		}
+
+		return res;
 	}
 
 public:
 	void generate_symbols() {
-		symbols_.clear();
-		stats_.reset();
+		clear();
 
 		add_symbol(text_img_to_symbol("########\n"
 		                              "        \n"
@@ -433,28 +692,16 @@ public:
 		                              "##\n"),
 		           ".");
 
-		JobQueue<std::string> job_queue(1000);
-		std::vector<std::thread> threads(std::thread::hardware_concurrency());
-
-		std::mutex symbols_mutex;
-		for (auto& thr : threads) {
-			thr = std::thread([&] {
-				try {
-					for (;;) {
-						auto tex = job_queue.get_job();
-						auto matrix = safe_tex_to_img_matrix(tex);
-						std::lock_guard<std::mutex> guard(symbols_mutex);
-						add_symbol(matrix, tex);
-					}
-				} catch (const decltype(job_queue)::NoMoreJobs&) {
-				}
-			});
-		}
+		auto texes = generate_tex_symbols();
+		std::vector<Matrix<int>> matrices(texes.size(), Matrix<int>(0, 0));
+		thread_pool().parallel_for(0, texes.size(), [&](size_t i) {
+			TraceScope trace("render symbol", "gen", "symbol", i);
+			matrices[i] = safe_tex_to_img_matrix(texes[i]);
+		});
 
-		generate_tex_symbols(job_queue);
+		for (size_t i = 0; i < texes.size(); ++i)
+			add_symbol(matrices[i], texes[i]);
 
-		job_queue.signal_no_more_jobs();
-		for (auto& thr : threads)
-			thr.join();
+		arena_ = SymbolArena(symbols_);
 	}
 };
@@ -0,0 +1,121 @@
+#pragma once
+
+#include "symbol_database.h"
+#include "thread_pool.h"
+#include "untex_img.h"
+
+#include <algorithm>
+#include <cstdlib>
+#include <numeric>
+#include <utility>
+#include <vector>
+
+struct SymbolDatabaseCompaction {
+	struct SymbolPair {
+		size_t first, second; // indexes in SymbolDatabase::symbols()
+		double diff;
+	};
+
+	std::vector<bool> kept; // kept[i] tells whether to keep the i-th symbol
+	// Removed symbols (second) with the kept symbols they were merged into
+	// (first), diff is the greater of the diffs in both directions
+	std::vector<SymbolPair> merged;
+	// Symbols with different tex that are close to each other, diff is the
+	// smaller of the diffs in both directions
+	std::vector<SymbolPair> confusable;
+};
+
+// Compares in parallel every pair of symbols that untexing could compare i.e.
+// of sizes differing by at most SYMBOL_SIZE_DIFF_THRESHOLD. A symbol is
+// removed if an earlier kept symbol has the same tex and their diffs in both
+// directions are at most @p merge_tolerance. Pairs with different tex and a
+// diff of at most @p confusable_margin are reported as confusable.
+inline SymbolDatabaseCompaction
+compact_symbol_database(const SymbolDatabase& sdb,
+                        double merge_tolerance,
+                        double confusable_margin) {
+	using SymbolPair = SymbolDatabaseCompaction::SymbolPair;
+
+	auto const& symbols = sdb.symbols();
+	auto const& stats = sdb.statistics();
+	const size_t n = symbols.size();
+
+	std::vector<PixelProbabilities> probs(
+	   n, PixelProbabilities(Matrix<double>(0, 0), 0));
+	thread_pool().parallel_for(0, n, [&](size_t i) {
+		probs[i] = stats.pixel_probabilities(symbols[i].img);
+	});
+
+	// Sorting by the number of rows lets every symbol be compared only with
+	// the following symbols of similar height
+	std::vector<size_t> by_rows(n);
+	std::iota(by_rows.begin(), by_rows.end(), 0);
+	std::stable_sort(by_rows.begin(), by_rows.end(), [&](size_t a, size_t b) {
+		return symbols[a].img.rows() < symbols[b].img.rows();
+	});
+
+	struct Pairs {
+		std::vector<SymbolPair> mergeable, confusable;
+	};
+	const double threshold = std::max(merge_tolerance, confusable_margin);
+	auto pairs = thread_pool().parallel_reduce(
+	   0, n, Pairs {},
+	   [&](Pairs& res, size_t k) {
+		   const Symbol& fir = symbols[by_rows[k]];
+		   for (size_t l = k + 1; l < n; ++l) {
+			   const Symbol& sec = symbols[by_rows[l]];
+			   if (sec.img.rows() - fir.img.rows() >
+			       SYMBOL_SIZE_DIFF_THRESHOLD) {
+				   break;
+			   }
+			   if (std::abs(sec.img.cols() - fir.img.cols()) >
+			       SYMBOL_SIZE_DIFF_THRESHOLD) {
+				   continue;
+			   }
+
+			   size_t a = std::min(by_rows[k], by_rows[l]);
+			   size_t b = std::max(by_rows[k], by_rows[l]);
+			   double ab = stats.img_diff(
+			      symbols[a].img, probs[a], symbols[b].img, threshold);
+			   double ba = stats.img_diff(
+			      symbols[b].img, probs[b], symbols[a].img, threshold);
+			   if (symbols[a].tex == symbols[b].tex) {
+				   if (std::max(ab, ba) <= merge_tolerance)
+					   res.mergeable.push_back({a, b, std::max(ab, ba)});
+			   } else if (std::min(ab, ba) <= confusable_margin) {
+				   res.confusable.push_back({a, b, std::min(ab, ba)});
+			   }
+		   }
+	   },
+	   [](Pairs a, Pairs b) {
+		   a.mergeable.insert(
+		      a.mergeable.end(), b.mergeable.begin(), b.mergeable.end());
+		   a.confusable.insert(
+		      a.confusable.end(), b.confusable.begin(), b.confusable.end());
+		   return a;
+	   });
+
+	auto by_indexes = [](const SymbolPair& x, const SymbolPair& y) {
+		return std::pair(x.second, x.first) < std::pair(y.second, y.first);
+	};
+	std::sort(pairs.mergeable.begin(), pairs.mergeable.end(), by_indexes);
+	std::sort(pairs.confusable.begin(), pairs.confusable.end(), by_indexes);
+
+	// Symbols are visited in order, so every removed symbol is merged into
+	// the first kept symbol close enough to it
+	SymbolDatabaseCompaction res;
+	res.kept.assign(n, true);
+	for (auto const& pair : pairs.mergeable) {
+		if (res.kept[pair.first] and res.kept[pair.second]) {
+			res.kept[pair.second] = false;
+			res.merged.emplace_back(pair);
+		}
+	}
+
+	for (auto const& pair : pairs.confusable) {
+		if (res.kept[pair.first] and res.kept[pair.second])
+			res.confusable.emplace_back(pair);
+	}
+
+	return res;
+}
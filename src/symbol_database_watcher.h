@@ -0,0 +1,277 @@
+#pragma once
+
+#include "log.h"
+#include "string.h"
+#include "symbol_database.h"
+#include "symbol_journal.h"
+#include "symbol_vp_tree.h"
+
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <poll.h>
+#include <stdexcept>
+#include <string>
+#include <sys/inotify.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+// Keeps a SymbolDatabase loaded from database files (with their journals, see
+// SymbolJournal) up to date while they change. Changes are noticed through
+// inotify and applied in a background thread: symbols appended to a file or
+// its journal are added to a copy of the current database, which is then
+// published as a new immutable snapshot. Users keep the snapshot they got from
+// snapshot() for as long as they need a consistent view, and getting one never
+// waits for an update. A file rewritten other than by appending (or by folding
+// its journal) makes the whole database reload. Indexes derived from the
+// database are built before publishing, so they never delay the users either.
+class SymbolDatabaseWatcher {
+public:
+	struct Snapshot {
+		std::shared_ptr<const SymbolDatabase> db;
+		// Built for db if requested, nullptr otherwise
+		std::shared_ptr<const SymbolVpTree> vp_tree;
+	};
+
+private:
+	struct File {
+		std::string name;
+		std::string base; // contents of the database file applied so far
+		std::string journal; // contents of the journal applied so far
+		std::unordered_set<std::string> images; // see SymbolJournal::img_key()
+	};
+
+	std::vector<File> files_;
+	bool build_vp_tree_;
+	std::shared_ptr<const Snapshot> snapshot_; // accessed atomically
+	std::mutex update_lock_;
+
+	int inotify_fd_ = -1;
+	int stop_pipe_[2] = {-1, -1};
+	// Watch descriptor => names of the watched files in the directory
+	std::vector<std::pair<int, std::string>> watched_names_;
+	std::thread thread_;
+
+public:
+	// Loads the database files @p files in order and starts watching them.
+	// If @p build_vp_tree, every snapshot has a SymbolVpTree of its database.
+	SymbolDatabaseWatcher(const std::vector<std::string>& files,
+	                      bool build_vp_tree)
+	   : build_vp_tree_(build_vp_tree) {
+		for (auto const& file : files)
+			files_.push_back({file, {}, {}, {}});
+
+		inotify_fd_ = inotify_init1(IN_CLOEXEC);
+		if (inotify_fd_ < 0 or pipe(stop_pipe_) != 0) {
+			close_fds();
+			throw std::runtime_error("Failed to initialize inotify");
+		}
+
+		for (auto const& file : files) {
+			// Directories are watched, as folding a journal replaces the file
+			std::filesystem::path path(file);
+			auto dir = path.parent_path();
+			int wd = inotify_add_watch(inotify_fd_,
+			                           dir.empty() ? "." : dir.c_str(),
+			                           IN_CLOSE_WRITE | IN_MOVED_TO);
+			if (wd < 0) {
+				close_fds();
+				throw std::runtime_error("Failed to watch " + file);
+			}
+
+			auto name = path.filename().string();
+			watched_names_.emplace_back(wd, name);
+			watched_names_.emplace_back(wd, name + ".journal");
+		}
+
+		// Loading after the watches are added, so no change is missed
+		try {
+			publish(load_all());
+		} catch (...) {
+			close_fds();
+			throw;
+		}
+
+		thread_ = std::thread([this] { watch(); });
+	}
+
+	SymbolDatabaseWatcher(const SymbolDatabaseWatcher&) = delete;
+	SymbolDatabaseWatcher& operator=(const SymbolDatabaseWatcher&) = delete;
+
+	~SymbolDatabaseWatcher() {
+		char c = 0;
+		if (write(stop_pipe_[1], &c, 1) == 1)
+			thread_.join();
+		else
+			thread_.detach();
+
+		close_fds();
+	}
+
+	std::shared_ptr<const Snapshot> snapshot() const {
+		return std::atomic_load(&snapshot_);
+	}
+
+	// Applies the changes of the files since the last update. Returns true
+	// iff. a new snapshot was published.
+	bool update() {
+		std::lock_guard<std::mutex> guard(update_lock_);
+		struct Change {
+			File& file;
+			SymbolJournal::Contents contents;
+			std::vector<SymbolDatabase::SymbolRecord> new_records;
+		};
+
+		std::vector<Change> changes;
+		for (auto& file : files_) {
+			auto contents = SymbolJournal(file.name).read();
+			std::string_view base =
+			   (contents.base ? *contents.base : std::string_view());
+			if (not has_prefix(base, file.base)) {
+				log_info("Reloading symbols, as ", file.name, " was rewritten");
+				publish(load_all());
+				return true;
+			}
+
+			changes.push_back({file, std::move(contents), {}});
+		}
+
+		size_t new_symbols = 0;
+		for (auto& change : changes) {
+			File& file = change.file;
+			std::string_view base = (change.contents.base
+			                            ? *change.contents.base
+			                            : std::string_view());
+			auto add_new = [&](const SymbolDatabase::SymbolRecord& rec) {
+				if (file.images.emplace(SymbolJournal::img_key(rec)).second)
+					change.new_records.emplace_back(rec);
+			};
+			// Records appended to the database file are new or were folded
+			// from the journal
+			for (auto const& rec : SymbolDatabase::split_records(
+			        base.substr(file.base.size()))) {
+				add_new(rec);
+			}
+
+			std::string_view journal = change.contents.journal;
+			auto journaled =
+			   SymbolJournal(file.name).journaled_symbols(journal);
+			// Records within the applied journal contents were applied. A
+			// journal folded or cut since does not extend them (even if it has
+			// as many records), so all its records are applied anew.
+			size_t applied_end =
+			   (base.size() == file.base.size() and
+			          has_prefix(journal, file.journal)
+			       ? file.journal.size()
+			       : 0);
+			for (auto symbol : journaled) {
+				if (size_t(symbol.data() - journal.data()) + symbol.size() <=
+				    applied_end) {
+					continue;
+				}
+
+				for (auto const& rec : SymbolDatabase::split_records(symbol))
+					add_new(rec);
+			}
+
+			file.base = base;
+			file.journal = journal;
+			new_symbols += change.new_records.size();
+		}
+
+		if (new_symbols == 0)
+			return false;
+
+		auto db = std::make_shared<SymbolDatabase>(*snapshot()->db);
+		for (auto const& change : changes)
+			db->add_records(change.new_records);
+
+		publish(std::move(db));
+		log_info("Loaded ", new_symbols, " new symbols");
+		return true;
+	}
+
+private:
+	void publish(std::shared_ptr<const SymbolDatabase> db) {
+		auto snapshot = std::make_shared<Snapshot>();
+		snapshot->db = std::move(db);
+		if (build_vp_tree_)
+			snapshot->vp_tree = std::make_shared<SymbolVpTree>(*snapshot->db);
+
+		std::atomic_store(&snapshot_,
+		                  std::shared_ptr<const Snapshot>(std::move(snapshot)));
+	}
+
+	// Like SymbolJournal::load() for every file
+	std::shared_ptr<const SymbolDatabase> load_all() {
+		auto db = std::make_shared<SymbolDatabase>();
+		for (auto& file : files_) {
+			auto contents = SymbolJournal(file.name).read();
+			file.base = contents.base.value_or("");
+			file.images.clear();
+			auto base_records = SymbolDatabase::split_records(file.base);
+			for (auto const& rec : base_records)
+				file.images.emplace(SymbolJournal::img_key(rec));
+			db->add_records(base_records);
+
+			auto journaled =
+			   SymbolJournal(file.name).journaled_symbols(contents.journal);
+			std::vector<SymbolDatabase::SymbolRecord> journal_records;
+			for (auto symbol : journaled) {
+				for (auto const& rec : SymbolDatabase::split_records(symbol)) {
+					if (file.images.emplace(SymbolJournal::img_key(rec)).second)
+						journal_records.emplace_back(rec);
+				}
+			}
+			db->add_records(journal_records);
+			file.journal = std::move(contents.journal);
+		}
+
+		return db;
+	}
+
+	void watch() {
+		pollfd fds[2] = {{inotify_fd_, POLLIN, 0}, {stop_pipe_[0], POLLIN, 0}};
+		alignas(inotify_event) char buff[4096];
+		for (;;) {
+			if (poll(fds, 2, -1) < 0) {
+				if (errno == EINTR)
+					continue;
+
+				log_error("Stopped watching symbols: poll() failed");
+				return;
+			}
+			if (fds[1].revents)
+				return;
+
+			ssize_t len = read(inotify_fd_, buff, sizeof(buff));
+			bool changed = false;
+			for (ssize_t pos = 0; pos < len;) {
+				auto* event = reinterpret_cast<inotify_event*>(buff + pos);
+				pos += sizeof(inotify_event) + event->len;
+				for (auto const& [wd, name] : watched_names_) {
+					changed |= (event->len > 0 and wd == event->wd and
+					            name == event->name);
+				}
+			}
+
+			if (not changed)
+				continue;
+
+			try {
+				update();
+			} catch (const std::exception& e) {
+				log_warning("Failed to update symbols: ", e.what());
+			}
+		}
+	}
+
+	void close_fds() noexcept {
+		for (int fd : {inotify_fd_, stop_pipe_[0], stop_pipe_[1]}) {
+			if (fd >= 0)
+				close(fd);
+		}
+	}
+};
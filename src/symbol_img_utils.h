@@ -1,5 +1,6 @@
 #pragma once
 
+#include "component.h"
 #include "matrix.h"
 
 #include <opencv2/opencv.hpp>
@@ -104,6 +105,89 @@ split_into_symbol_groups(const Matrix<int>& mat) {
 	return symbol_groups;
 }
 
+// Like split_into_symbol_groups(), but symbols are built of connected
+// components instead of ranges of columns separated by empty columns.
+// Components overlapping on at least half of the width of the narrower one are
+// merged into one symbol, what keeps multi-part glyphs (e.g. "=", "i", ":" or
+// a fraction) together, but separates glyphs that only slightly overlap
+// (e.g. slanted neighbouring letters). Symbols are ordered by their first
+// column.
+template <size_t N>
+std::array<std::vector<SplitSymbol>, N>
+split_into_symbol_groups_by_components(const Matrix<int>& mat) {
+	using Box = Components::Box;
+
+	Components comps(mat);
+	std::vector<Box> boxes;
+	for (int cid = 0; cid < comps.components(); ++cid)
+		boxes.emplace_back(comps.box(cid));
+
+	// Merge components into symbols, boxes[x] is the box of the whole symbol
+	// for the representative x
+	DSU symbols(boxes.size());
+	auto should_merge = [](const Box& a, const Box& b) {
+		int overlap = std::min(a.right, b.right) - std::max(a.left, b.left) + 1;
+		return overlap * 2 >= std::min(a.cols(), b.cols());
+	};
+	for (bool merged = true; merged;) {
+		merged = false;
+		for (size_t i = 0; i < boxes.size(); ++i) {
+			for (size_t j = i + 1; j < boxes.size(); ++j) {
+				int x = symbols.find(i);
+				int y = symbols.find(j);
+				if (x == y or not should_merge(boxes[x], boxes[y]))
+					continue;
+
+				symbols.join(y, x);
+				boxes[x].extend(boxes[y]);
+				merged = true;
+			}
+		}
+	}
+
+	std::vector<int> order; // representatives of the symbols
+	for (size_t x = 0; x < boxes.size(); ++x) {
+		if (symbols.find(x) == (int)x)
+			order.emplace_back(x);
+	}
+	std::sort(order.begin(), order.end(), [&](int x, int y) {
+		return std::pair(boxes[x].left, boxes[x].top) <
+		       std::pair(boxes[y].left, boxes[y].top);
+	});
+
+	std::vector<int> symbol_pos(boxes.size()); // component => symbol position
+	for (size_t pos = 0; pos < order.size(); ++pos)
+		symbol_pos[order[pos]] = pos;
+	for (size_t id = 0; id < boxes.size(); ++id)
+		symbol_pos[id] = symbol_pos[symbols.find(id)];
+
+	std::array<std::vector<SplitSymbol>, N> symbol_groups;
+	for (size_t k = 0; k < N; ++k) {
+		for (size_t beg = 0; beg + k < order.size(); ++beg) {
+			Box box = boxes[order[beg]];
+			for (size_t pos = beg + 1; pos <= beg + k; ++pos)
+				box.extend(boxes[order[pos]]);
+
+			// Only pixels of the grouped symbols, not of the overlapping ones
+			Matrix<int> img(box.rows(), box.cols());
+			for (int r = box.top; r <= box.bottom; ++r) {
+				for (int c = box.left; c <= box.right; ++c) {
+					int id = comps.component_id(r, c);
+					img[r - box.top][c - box.left] =
+					   (id != -1 and symbol_pos[id] >= (int)beg and
+					    symbol_pos[id] <= int(beg + k));
+				}
+			}
+
+			int bottom_rows_cut = mat.rows() - 1 - box.bottom;
+			symbol_groups[k].push_back(
+			   {std::move(img), box.left, box.top, bottom_rows_cut});
+		}
+	}
+
+	return symbol_groups;
+}
+
 int symbol_horizontal_distance(const SplitSymbol& fir, const SplitSymbol& sec);
 
 // Returns path of the png_file
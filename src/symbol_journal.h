@@ -0,0 +1,393 @@
+#pragma once
+
+#include "log.h"
+#include "symbol_database.h"
+
+#include <array>
+#include <cerrno>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <fcntl.h>
+#include <filesystem>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_set>
+#include <vector>
+
+// Symbols learned since the last compaction are appended to a journal next to
+// the database file (<db_file>.journal) rather than to the database file, and
+// compact() folds them into it. Every journal record is
+// "<length> <crc32> <symbol record>", so a record torn by a crash is detected
+// and skipped, and the next append cuts it off. Writers hold an exclusive
+// flock() of the journal and readers a shared one, so concurrent learns do
+// not interleave and readers see the database file and the journal from the
+// same moment.
+class SymbolJournal {
+	// learn folds the journal once it has that many records
+	static constexpr size_t COMPACT_AFTER_RECORDS = 64;
+
+	std::string db_file_;
+	std::string journal_file_;
+
+	// Holds the journal open and flock()ed while alive
+	class Lock {
+		int fd_ = -1;
+
+	public:
+		// A shared lock of a nonexistent journal holds nothing; an exclusive
+		// lock creates the journal
+		Lock(const std::string& filename, int operation) {
+			bool exclusive = (operation == LOCK_EX);
+			fd_ = open(filename.c_str(),
+			           exclusive ? O_RDWR | O_CREAT | O_APPEND : O_RDONLY,
+			           0644);
+			if (fd_ < 0) {
+				if (not exclusive and errno == ENOENT)
+					return;
+
+				throw std::runtime_error("Failed to open " + filename);
+			}
+
+			while (flock(fd_, operation) != 0) {
+				if (errno != EINTR) {
+					close(fd_);
+					throw std::runtime_error("Failed to lock " + filename);
+				}
+			}
+		}
+
+		Lock(const Lock&) = delete;
+		Lock& operator=(const Lock&) = delete;
+
+		~Lock() {
+			if (fd_ >= 0)
+				close(fd_); // Releases the lock
+		}
+
+		bool holds_file() const noexcept { return fd_ >= 0; }
+
+		std::string read() const {
+			std::string res;
+			if (fd_ < 0)
+				return res;
+
+			struct stat st;
+			if (fstat(fd_, &st) != 0)
+				throw std::runtime_error("Failed to stat the journal");
+
+			res.resize(st.st_size);
+			size_t done = 0;
+			while (done < res.size()) {
+				ssize_t rc =
+				   pread(fd_, res.data() + done, res.size() - done, done);
+				if (rc < 0 and errno == EINTR)
+					continue;
+				if (rc <= 0)
+					throw std::runtime_error("Failed to read the journal");
+
+				done += rc;
+			}
+
+			return res;
+		}
+
+		void append(std::string_view data) const {
+			while (not data.empty()) {
+				ssize_t rc = write(fd_, data.data(), data.size());
+				if (rc < 0 and errno == EINTR)
+					continue;
+				if (rc < 0)
+					throw std::runtime_error("Failed to append to the journal");
+
+				data.remove_prefix(rc);
+			}
+
+			if (fsync(fd_) != 0)
+				throw std::runtime_error("Failed to sync the journal");
+		}
+
+		// Cuts the journal to its first @p size bytes
+		void truncate(off_t size = 0) const {
+			if (ftruncate(fd_, size) != 0)
+				throw std::runtime_error("Failed to truncate the journal");
+			if (fsync(fd_) != 0)
+				throw std::runtime_error("Failed to sync the journal");
+		}
+	};
+
+	static uint32_t crc32(std::string_view data) noexcept {
+		static constexpr auto table = [] {
+			std::array<uint32_t, 256> res {};
+			for (uint32_t i = 0; i < 256; ++i) {
+				uint32_t x = i;
+				for (int k = 0; k < 8; ++k)
+					x = (x & 1 ? 0xedb88320 ^ (x >> 1) : x >> 1);
+				res[i] = x;
+			}
+			return res;
+		}();
+
+		uint32_t crc = 0xffffffff;
+		for (unsigned char c : data)
+			crc = table[(crc ^ c) & 0xff] ^ (crc >> 8);
+
+		return ~crc;
+	}
+
+	// Returns the length of the valid journal record at the beginning of
+	// @p journal and sets @p symbol to its symbol record, or returns 0 if
+	// there is no valid record there
+	static size_t valid_record(std::string_view journal,
+	                           std::string_view& symbol) noexcept {
+		const char* beg = journal.data();
+		const char* end = beg + journal.size();
+		size_t len;
+		uint32_t crc;
+		auto [len_end, len_ec] = std::from_chars(beg, end, len);
+		if (len_ec != std::errc() or end - len_end < 1 or *len_end != ' ')
+			return 0;
+
+		auto [crc_end, crc_ec] = std::from_chars(len_end + 1, end, crc, 16);
+		if (crc_ec != std::errc() or crc_end - len_end != 9 or
+		    end - crc_end < 1 or *crc_end != ' ') {
+			return 0;
+		}
+
+		size_t header_len = crc_end + 1 - beg;
+		if (journal.size() - header_len < len)
+			return 0;
+
+		symbol = journal.substr(header_len, len);
+		if (crc32(symbol) != crc)
+			return 0;
+
+		return header_len + len;
+	}
+
+	struct ParsedJournal {
+		std::vector<std::string_view> symbols; // of the valid records
+		size_t valid_end = 0; // end of the last valid record
+		size_t skipped = 0; // number of bytes not in any valid record
+	};
+
+	// A torn or corrupted record is skipped byte by byte until a valid record
+	// begins, rather than by the length in its header, which may be damaged
+	// or may cover records appended after it
+	static ParsedJournal parse(std::string_view journal) {
+		ParsedJournal res;
+		for (size_t pos = 0; pos < journal.size();) {
+			std::string_view symbol;
+			if (size_t len = valid_record(journal.substr(pos), symbol)) {
+				res.symbols.emplace_back(symbol);
+				pos += len;
+				res.valid_end = pos;
+			} else {
+				++res.skipped;
+				++pos;
+			}
+		}
+
+		return res;
+	}
+
+	// Syncs the directory of the database file, so that a rename() of it
+	// survives a crash
+	void sync_db_dir() const {
+		auto dir = std::filesystem::path(db_file_).parent_path();
+		int fd = open(dir.empty() ? "." : dir.c_str(), O_RDONLY | O_DIRECTORY);
+		bool synced = (fd >= 0 and fsync(fd) == 0);
+		if (fd >= 0)
+			close(fd);
+		if (not synced)
+			throw std::runtime_error("Failed to sync the directory of " +
+			                         db_file_);
+	}
+
+	static std::string journal_record(std::string_view symbol_record) {
+		char header[32];
+		snprintf(header,
+		         sizeof(header),
+		         "%zu %08x ",
+		         symbol_record.size(),
+		         crc32(symbol_record));
+		return header + std::string(symbol_record);
+	}
+
+	// Returns the journaled symbols with images not present before them in
+	// @p base or the journal. Duplicates of base symbols are left by
+	// compactions interrupted before truncating the journal.
+	static std::string
+	new_journaled_symbols(const std::string& base,
+	                      const std::vector<std::string_view>& journaled) {
+		std::unordered_set<std::string> images;
+		for (auto const& rec : SymbolDatabase::split_records(base))
+			images.emplace(img_key(rec));
+
+		std::string res;
+		for (auto symbol : journaled) {
+			auto recs = SymbolDatabase::split_records(symbol);
+			if (recs.size() == 1 and images.emplace(img_key(recs[0])).second)
+				res += symbol;
+		}
+
+		return res;
+	}
+
+	// Replaces the database file with its symbols followed by the journaled
+	// ones and empties the journal. Returns the number of folded symbols.
+	size_t fold(const Lock& lock,
+	            const std::string& base,
+	            std::string_view journal) const {
+		auto parsed = parse(journal);
+		if (parsed.skipped > 0) {
+			log_warning("Discarding ",
+			            parsed.skipped,
+			            " bytes of torn or corrupted records of ",
+			            journal_file_,
+			            " while folding it");
+		}
+		std::string folded = new_journaled_symbols(base, parsed.symbols);
+
+		// Renaming makes the new database file appear at once
+		std::string tmp_file = db_file_ + ".tmp";
+		int fd = open(tmp_file.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd < 0)
+			throw std::runtime_error("Failed to open " + tmp_file);
+
+		bool written = true;
+		for (std::string_view data : {std::string_view(base),
+		                              std::string_view(folded)}) {
+			while (written and not data.empty()) {
+				ssize_t rc = write(fd, data.data(), data.size());
+				if (rc < 0 and errno == EINTR)
+					continue;
+
+				written = (rc > 0);
+				if (written)
+					data.remove_prefix(rc);
+			}
+		}
+		written = written and fsync(fd) == 0;
+		close(fd);
+		if (not written)
+			throw std::runtime_error("Failed to write " + tmp_file);
+
+		if (rename(tmp_file.c_str(), db_file_.c_str()) != 0)
+			throw std::runtime_error("Failed to replace " + db_file_);
+
+		// Otherwise a crash could leave the old database file and the
+		// truncated journal
+		sync_db_dir();
+		lock.truncate();
+		return SymbolDatabase::split_records(folded).size();
+	}
+
+public:
+	explicit SymbolJournal(std::string db_file)
+	   : db_file_(std::move(db_file)), journal_file_(db_file_ + ".journal") {}
+
+	// Returns the symbol records of the valid journal records
+	std::vector<std::string_view>
+	journaled_symbols(std::string_view journal) const {
+		auto parsed = parse(journal);
+		if (parsed.skipped > 0) {
+			log_warning("Ignoring ",
+			            parsed.skipped,
+			            " bytes of torn or corrupted records of ",
+			            journal_file_);
+		}
+
+		return std::move(parsed.symbols);
+	}
+
+	// Key identifying the image of a symbol record, symbols are unique by
+	// their images
+	static std::string img_key(const SymbolDatabase::SymbolRecord& rec) {
+		return std::to_string(rec.rows) + ' ' + std::to_string(rec.cols) +
+		       ' ' + std::string(rec.img_data);
+	}
+
+	struct Contents {
+		std::optional<std::string> base; // contents of the database file
+		std::string journal; // empty if the journal does not exist
+	};
+
+	// Reads the database file and the journal at one moment
+	Contents read() const {
+		Lock lock(journal_file_, LOCK_SH);
+		return {SymbolDatabase::read_file(db_file_), lock.read()};
+	}
+
+	// Adds symbols of the database file and the journal to @p sdb. Returns
+	// false iff. neither of the files exists.
+	bool load(SymbolDatabase& sdb) const {
+		Lock lock(journal_file_, LOCK_SH);
+		auto base = SymbolDatabase::read_file(db_file_);
+		if (not base and not lock.holds_file())
+			return false;
+
+		if (not base)
+			base.emplace();
+
+		std::string journal = lock.read();
+		sdb.add_from_string(*base);
+		sdb.add_from_string(
+		   new_journaled_symbols(*base, journaled_symbols(journal)));
+		return true;
+	}
+
+	// Appends the symbol to the journal unless the database or the journal
+	// already contain a symbol with the same image. Returns false iff. the
+	// symbol was not appended.
+	bool append(const Matrix<int>& img, const std::string& tex) const {
+		Lock lock(journal_file_, LOCK_EX);
+		std::string base = SymbolDatabase::read_file(db_file_).value_or("");
+		std::string journal = lock.read();
+		auto parsed = parse(journal);
+
+		std::string symbol = SymbolDatabase::encode_symbol(img, tex);
+		auto key = img_key(SymbolDatabase::split_records(symbol)[0]);
+		for (auto const& rec : SymbolDatabase::split_records(base)) {
+			if (img_key(rec) == key)
+				return false;
+		}
+		auto const& journaled = parsed.symbols;
+		for (auto journaled_symbol : journaled) {
+			auto recs = SymbolDatabase::split_records(journaled_symbol);
+			if (recs.size() == 1 and img_key(recs[0]) == key)
+				return false;
+		}
+
+		// A record appended after a torn one would be swallowed by it
+		if (parsed.valid_end < journal.size()) {
+			log_warning("Cutting the torn end of ", journal_file_);
+			lock.truncate(parsed.valid_end);
+			journal.resize(parsed.valid_end);
+		}
+
+		auto record = journal_record(symbol);
+		lock.append(record);
+		if (journaled.size() + 1 >= COMPACT_AFTER_RECORDS)
+			fold(lock, base, journal + record);
+
+		return true;
+	}
+
+	// Folds the journal into the database file. Returns the number of folded
+	// symbols.
+	size_t compact() const {
+		Lock lock(journal_file_, LOCK_EX);
+		std::string journal = lock.read();
+		if (journal.empty())
+			return 0;
+
+		return fold(
+		   lock, SymbolDatabase::read_file(db_file_).value_or(""), journal);
+	}
+};
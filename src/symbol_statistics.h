@@ -7,15 +7,81 @@
 #include <algorithm>
 #include <array>
 #include <cmath>
+#include <cstdint>
 #include <iostream>
+#include <limits>
+#include <optional>
+#include <vector>
+
+// Probabilities of pixels of an image extended infinitely with empty pixels
+class PixelProbabilities {
+	Matrix<double> probs_; // probs_[r + 1][c + 1] is probability of pixel (r, c)
+	double outside_prob_; // probability of every pixel not covered by probs_
+
+public:
+	PixelProbabilities(Matrix<double> probs, double outside_prob)
+	   : probs_(std::move(probs)), outside_prob_(outside_prob) {}
+
+	double operator()(int r, int c) const noexcept {
+		++r;
+		++c;
+		if (r < 0 or c < 0 or r >= probs_.rows() or c >= probs_.cols())
+			return outside_prob_;
+
+		return probs_[r][c];
+	}
+};
 
 class SymbolStatistics {
-	std::array<int, 1 << 9> stats_ = {};
+public:
+	// Number of occurrences of every mask
+	using Counts = std::array<int, 1 << 9>;
+
+private:
+	static constexpr int CENTER_MASK = 1 << 4;
+
+	Counts stats_;
+	std::array<double, 1 << 9> prob_; // prob_[mask] == calc_prob_pxiel(mask)
+
+	double calc_prob_pxiel(int mask) const noexcept {
+		int w_mask = mask |= CENTER_MASK;
+		int wo_mask = mask & ~CENTER_MASK;
+		int w_count = stats_[w_mask];
+		int wo_count = stats_[wo_mask];
+		if (mask & CENTER_MASK)
+			++w_count;
+		else
+			++wo_count;
+
+		return (double)w_count / (w_count + wo_count);
+	}
 
 public:
-	void reset() noexcept { std::fill(stats_.begin(), stats_.end(), 0); }
+	SymbolStatistics() noexcept { reset(); }
+
+	void reset() noexcept {
+		std::fill(stats_.begin(), stats_.end(), 0);
+		for (size_t mask = 0; mask < prob_.size(); ++mask)
+			prob_[mask] = calc_prob_pxiel(mask);
+	}
+
+	const Counts& counts() const noexcept { return stats_; }
 
-	void increment(int mask) noexcept { ++stats_[mask]; }
+	// Equivalent to calling increment() counts[mask] times for every mask
+	void add(const Counts& counts) noexcept {
+		for (size_t mask = 0; mask < stats_.size(); ++mask)
+			stats_[mask] += counts[mask];
+		for (size_t mask = 0; mask < prob_.size(); ++mask)
+			prob_[mask] = calc_prob_pxiel(mask);
+	}
+
+	void increment(int mask) noexcept {
+		++stats_[mask];
+		// Probability of a mask depends only on the counts of the mask with
+		// and without the center pixel
+		prob_[mask | CENTER_MASK] = prob_[mask & ~CENTER_MASK] =
+		   calc_prob_pxiel(mask);
+	}
 
 	template <class U>
 	static int mask(const SubmatrixView<int, U>& mat, int r, int c) {
@@ -41,20 +107,96 @@ public:
 		return mask(SubmatrixView<int, U>(mat), r, c);
 	}
 
-	double prob_pxiel(int mask) const noexcept {
-		constexpr int center_mask = 1 << 4;
-		int w_mask = mask |= center_mask;
-		int wo_mask = mask & ~center_mask;
-		int w_count = stats_[w_mask];
-		int wo_count = stats_[wo_mask];
-		if (mask & center_mask)
-			++w_count;
-		else
-			++wo_count;
+	// Guard cells are used instead of checking bounds, so it has to be ensured
+	// that they are zero
+	template <class U, int BORDER>
+	static int mask(const PaddedMatrix<U, BORDER>& mat, int r, int c) {
+		static_assert(BORDER >= 1);
+		int res = 0;
+		for (int i = 0; i < 3; ++i) {
+			const U* row = mat[r - 1 + i] + c - 1;
+			for (int j = 0; j < 3; ++j)
+				res |= bool(row[j]) << (i * 3 + j);
+		}
 
-		return (double)w_count / (w_count + wo_count);
+		return res;
+	}
+
+	// Returns masks of all pixels of @p mat extended with one empty pixel
+	// border i.e. res[r + 1][c + 1] == mask(mat, r, c) for r \in [-1, rows]
+	// and c \in [-1, cols]. It is done in one sliding window pass: each row is
+	// turned into the row of horizontal 3-bit triples and then three
+	// consecutive rows of triples are combined into masks.
+	template <class U>
+	static Matrix<int> mask_image(const SubmatrixView<int, U>& mat) {
+		int rows = mat.rows() + 2;
+		int cols = mat.cols() + 2;
+		// triples[r][c] holds bits of pixels (r, c - 1), (r, c), (r, c + 1)
+		// of the extended image
+		PaddedMatrix<int> triples(rows, cols);
+		for (int r = 0; r < mat.rows(); ++r) {
+			int* trow = triples[r + 1];
+			const U* row = mat[r];
+			for (int c = 0; c < mat.cols(); ++c) {
+				int bit = bool(row[c]);
+				trow[c] |= bit << 2;
+				trow[c + 1] |= bit << 1;
+				trow[c + 2] |= bit;
+			}
+		}
+
+		Matrix<int> res(rows, cols);
+		for (int r = 0; r < rows; ++r) {
+			const int* above = triples[r - 1];
+			const int* curr = triples[r];
+			const int* below = triples[r + 1];
+			int* rrow = res[r];
+			for (int c = 0; c < cols; ++c)
+				rrow[c] = above[c] | (curr[c] << 3) | (below[c] << 6);
+		}
+
+		return res;
+	}
+
+	template <class U>
+	static Matrix<int> mask_image(const Matrix<U>& mat) {
+		return mask_image(SubmatrixView<int, U>(mat));
+	}
+
+	// Adds mask(mat, r, c) of every pixel of @p mat to @p counts. It works
+	// like mask_image(), but keeps only three rows of triples at once.
+	template <class U>
+	static void count_masks(const Matrix<U>& mat, Counts& counts) {
+		int cols = mat.cols();
+		// Triples of rows r - 1, r and r + 1: triples[c] holds bits of pixels
+		// (r, c - 1), (r, c), (r, c + 1)
+		std::vector<int> above(cols), curr(cols), below(cols);
+		auto calc_triples = [&](int r, std::vector<int>& triples) {
+			if (r >= mat.rows()) {
+				std::fill(triples.begin(), triples.end(), 0);
+				return;
+			}
+
+			const U* row = mat[r];
+			for (int c = 0; c < cols; ++c) {
+				triples[c] = (c > 0 and row[c - 1]) |
+				             bool(row[c]) << 1 |
+				             (c + 1 < cols and row[c + 1]) << 2;
+			}
+		};
+
+		calc_triples(0, below);
+		for (int r = 0; r < mat.rows(); ++r) {
+			std::swap(above, curr);
+			std::swap(curr, below);
+			calc_triples(r + 1, below);
+			for (int c = 0; c < cols; ++c)
+				++counts[above[c] | curr[c] << 3 | below[c] << 6];
+		}
 	}
 
+	double prob_pxiel(int mask) const noexcept { return prob_[mask]; }
+
 	template <class U>
 	double prob_pxiel(const SubmatrixView<int, U>& mat, int r, int c) const
 	   noexcept {
@@ -82,41 +224,233 @@ public:
 	Matrix<double> calc_prob_pixels(const SubmatrixView<int>& mat) const {
 		int rows = mat.rows();
 		int cols = mat.cols();
+		auto masks = mask_image(mat);
 		Matrix<double> res(rows, cols);
 		for (int i = 0; i < rows; ++i)
 			for (int j = 0; j < cols; ++j)
-				res[i][j] = prob_pxiel(mat, i, j);
+				res[i][j] = prob_[masks[i + 1][j + 1]];
 
 		return res;
 	}
 
+	PixelProbabilities pixel_probabilities(const SubmatrixView<int>& mat) const {
+		auto masks = mask_image(mat);
+		Matrix<double> probs(masks.rows(), masks.cols());
+		for (int i = 0; i < masks.rows(); ++i)
+			for (int j = 0; j < masks.cols(); ++j)
+				probs[i][j] = prob_[masks[i][j]];
+
+		return {std::move(probs), prob_[0]};
+	}
+
+	// Bit c of the r-th element is the pixel (r, c)
+	using RowBits = uint64_t;
+
+	// Stores rows of binary @p img at most 64 pixels wide as RowBits. Returns
+	// false iff. @p img does not fit or is not binary.
+	static bool to_row_bits(const SubmatrixView<int>& img,
+	                        std::vector<RowBits>& bits) {
+		if (img.cols() > std::numeric_limits<RowBits>::digits)
+			return false;
+
+		bits.assign(img.rows(), 0);
+		for (int r = 0; r < img.rows(); ++r) {
+			auto row = img.row(r);
+			for (int c = 0; c < row.size(); ++c) {
+				if (row[c] != 0 and row[c] != 1)
+					return false;
+
+				bits[r] |= RowBits(row[c]) << c;
+			}
+		}
+
+		return true;
+	}
+
+	// Specialization of img_diff() for images that (extended by MAX_OFFSET
+	// on every side) are at most 64 pixels wide: every row is stored as bits
+	// of uint64_t, so the difference map of a row is a single XOR and only
+	// the differing cells are visited. Returns the same value as the generic
+	// version or nothing if the images do not fit or are not binary.
+	template <size_t MAX_OFFSET = 1>
+	std::optional<double>
+	bitboard_img_diff(const SubmatrixView<int>& first,
+	                  const PixelProbabilities& first_probs,
+	                  const SubmatrixView<int>& second,
+	                  double diff_threshold) const {
+		std::vector<RowBits> first_bits, second_bits;
+		if (not to_row_bits(first, first_bits) or
+		    not to_row_bits(second, second_bits)) {
+			return std::nullopt;
+		}
+
+		return bitboard_img_diff<MAX_OFFSET>(first_bits.data(),
+		                                     first.rows(),
+		                                     first.cols(),
+		                                     first_probs,
+		                                     second_bits.data(),
+		                                     second.rows(),
+		                                     second.cols(),
+		                                     diff_threshold);
+	}
+
+	// The same for images given as to_row_bits() of them, which lets callers
+	// convert every image only once
+	template <size_t MAX_OFFSET = 1>
+	std::optional<double>
+	bitboard_img_diff(const RowBits* first_bits,
+	                  int first_rows,
+	                  int first_cols,
+	                  const PixelProbabilities& first_probs,
+	                  const RowBits* second_bits,
+	                  int second_rows,
+	                  int second_cols,
+	                  double diff_threshold) const {
+		using Bits = RowBits;
+		constexpr int MO = MAX_OFFSET;
+		// Rows of second are shifted by up to 2 * MO and mask() reads one more
+		constexpr int SEC_PADDING = 2 * MO + 1;
+
+		int rows = std::max(first_rows, second_rows) + 2 * MO;
+		int cols = std::max(first_cols, second_cols) + 2 * MO;
+		if (cols > std::numeric_limits<Bits>::digits)
+			return std::nullopt;
+
+		// fir[i] is row i of first shifted by (MO, MO)
+		std::vector<Bits> fir(rows);
+		for (int r = 0; r < first_rows; ++r)
+			fir[r + MO] = first_bits[r] << MO;
+
+		// sec[r + SEC_PADDING] is row r of second
+		std::vector<Bits> sec(rows + 1 + SEC_PADDING);
+		for (int r = 0; r < second_rows; ++r)
+			sec[r + SEC_PADDING] = second_bits[r];
+
+		// Bits of columns c - 1, c, c + 1
+		auto window3 = [](Bits row, int c) -> int {
+			return (c == 0 ? row << 1 : row >> (c - 1)) & 7;
+		};
+		// Index of the lowest set bit
+		auto lsb = [](Bits x) { return __builtin_ctzll(x); };
+
+		constexpr double DIFFERING_CELL_PENALTY = 1e-3;
+
+		// Terms are added in exactly the same order as in img_diff(), and the
+		// zero terms of sum3x3() (of not differing cells) are skipped, which
+		// does not change the result
+		auto img_diff_with_offset =
+		   [&, differ = std::vector<Bits>(rows),
+		    diff_orig = Matrix<double>(rows, cols)](int dr, int dc) mutable {
+			   dr += MO;
+			   dc += MO;
+			   // Row i of second shifted by (dr, dc)
+			   auto sec_row = [&](int i) {
+				   return sec[i - dr + SEC_PADDING] << dc;
+			   };
+
+			   auto diff = [&](int r, int c) {
+				   double sum = 0;
+				   int rlim = std::min(r + 2, rows);
+				   for (int i = std::max(r - 1, 0); i < rlim; ++i) {
+					   for (int bits = window3(differ[i], c); bits;
+					        bits &= bits - 1) {
+						   sum += diff_orig[i][c - 1 + lsb(bits)];
+					   }
+				   }
+
+				   return std::abs(sum);
+			   };
+
+			   double diff_sum = 0;
+			   for (int i = 0; i < rows; ++i) {
+				   differ[i] = fir[i] ^ sec_row(i);
+				   Bits prev = (i > 0 ? differ[i - 1] : 0);
+				   Bits curr = differ[i];
+				   // The diff of cell (i - 1, c) is added just before the
+				   // penalty of cell (i, c + 2)
+				   while (prev or curr) {
+					   bool prev_first = (prev != 0);
+					   if (prev and curr)
+						   prev_first = (lsb(prev) + 2 <= lsb(curr));
+
+					   if (prev_first) {
+						   diff_sum += diff(i - 1, lsb(prev));
+						   if (diff_sum > diff_threshold)
+							   return diff_sum;
+
+						   prev &= prev - 1;
+					   } else {
+						   int c = lsb(curr);
+						   diff_sum += DIFFERING_CELL_PENALTY;
+						   int mask = window3(sec_row(i - 1), c) |
+						              window3(sec_row(i), c) << 3 |
+						              window3(sec_row(i + 1), c) << 6;
+						   diff_orig[i][c] =
+						      first_probs(i - MO, c - MO) - prob_pxiel(mask);
+						   curr &= curr - 1;
+					   }
+				   }
+			   }
+
+			   for (Bits last = differ[rows - 1]; last; last &= last - 1) {
+				   diff_sum += diff(rows - 1, lsb(last));
+				   if (diff_sum > diff_threshold)
+					   return diff_sum;
+			   }
+
+			   return diff_sum;
+		   };
+
+		double min_diff = std::numeric_limits<double>::max();
+		for (int dr = -MO; dr <= MO; ++dr)
+			for (int dc = -MO; dc <= MO; ++dc)
+				min_diff = std::min(min_diff, img_diff_with_offset(dr, dc));
+
+		return min_diff;
+	}
+
+	template <size_t MAX_OFFSET = 1>
+	double
+	img_diff(const SubmatrixView<int>& first,
+	         const SubmatrixView<int>& second,
+	         double diff_threshold = std::numeric_limits<double>::max()) const {
+		return img_diff<MAX_OFFSET>(
+		   first, pixel_probabilities(first), second, diff_threshold);
+	}
+
+	// @p first_probs has to be pixel_probabilities(first), it allows comparing
+	// the same first image against many others without recomputing it
 	template <size_t MAX_OFFSET = 1>
 	double
 	img_diff(const SubmatrixView<int>& first,
+	         const PixelProbabilities& first_probs,
 	         const SubmatrixView<int>& second,
 	         double diff_threshold = std::numeric_limits<double>::max()) const {
 		constexpr bool debug = false;
+		if constexpr (not debug) {
+			auto res = bitboard_img_diff<MAX_OFFSET>(
+			   first, first_probs, second, diff_threshold);
+			if (res)
+				return *res;
+		}
 
 		// first image will be shifted by (x, y) for each x, y \in [-MAX_OFFSET,
 		// MAX_OFFSET] and then compared with second
 		int rows = std::max(first.rows(), second.rows());
 		int cols = std::max(first.cols(), second.cols());
 		Matrix<int> fir(rows + MAX_OFFSET * 2, cols + MAX_OFFSET * 2);
+		for (int r = 0; r < first.rows(); ++r) {
+			auto src = first.row(r);
+			std::copy(src.begin(), src.end(), fir[r + MAX_OFFSET] + MAX_OFFSET);
+		}
 
-		auto copy_submatrix_with_offset = [](Matrix<int>& dest,
-		                                     const SubmatrixView<int>& src,
-		                                     int dr,
-		                                     int dc) {
-			dr += MAX_OFFSET;
-			dc += MAX_OFFSET;
-
-			dest.fill(0);
-			for (int r = 0; r < src.rows(); ++r)
-				for (int c = 0; c < src.cols(); ++c)
-					dest[r + dr][c + dc] = src[r][c];
-		};
-
-		copy_submatrix_with_offset(fir, first, 0, 0);
+		// second extended with empty cells so that it can be accessed (also
+		// by mask()) in every shifted position without bounds checks
+		PaddedMatrix<int, MAX_OFFSET * 2 + 1> sec(rows, cols);
+		for (int r = 0; r < second.rows(); ++r) {
+			auto src = second.row(r);
+			std::copy(src.begin(), src.end(), sec[r]);
+		}
 
 		if constexpr (debug) {
 			show_matrix(calc_prob_pixels(first));
@@ -128,18 +462,23 @@ public:
 
 		constexpr double DIFFERING_CELL_PENALTY = 1e-3;
 
+		// The difference for the offset is the sum of DIFFERING_CELL_PENALTY
+		// and abs(sum3x3(diff_orig)) over all differing cells. The difference
+		// map is computed row by row, so that rows that do not differ (most of
+		// them for similar images) are skipped without touching the cells.
 		auto hard_img_diff_with_offset =
 		   [&,
+		    rows = fir.rows(),
+		    cols = fir.cols(),
 		    diff = Matrix<double>(fir.rows(), fir.cols()),
-		    diff_orig = Matrix<double>(fir.rows(), fir.cols()),
+		    diff_orig = PaddedMatrix<double>(fir.rows(), fir.cols()),
 		    differ = Matrix<char>(fir.rows(), fir.cols())](int dr,
 		                                                   int dc) mutable {
 			   dr += MAX_OFFSET;
 			   dc += MAX_OFFSET;
 
-			   diff.fill(0);
-			   diff_orig.fill(0);
-			   differ.fill(0);
+			   if constexpr (debug)
+				   diff.fill(0);
 
 			   double diff_sum = 0;
 			   // Returns true iff. the sum has exceeded the threshold
@@ -151,37 +490,51 @@ public:
 				   diff_sum += diff[r][c];
 				   return (diff_sum > diff_threshold);
 			   };
-			   for (int i = 0; i < diff.rows(); ++i) {
-				   for (int j = 0; j < diff.cols(); ++j) {
-					   if (update_diff_sum(i - 1, j - 2))
-						   return diff_sum;
+			   bool prev_row_differs = false;
+			   for (int i = 0; i < rows; ++i) {
+				   // Difference map of the whole row at once, what allows
+				   // vectorization
+				   const int* fir_row = fir[i];
+				   const int* sec_row = sec[i - dr] - dc;
+				   char* differ_row = differ[i];
+				   double* diff_orig_row = diff_orig[i];
+				   char row_differs = 0;
+				   for (int j = 0; j < cols; ++j) {
+					   differ_row[j] = (fir_row[j] != sec_row[j]);
+					   row_differs |= differ_row[j];
+					   diff_orig_row[j] = 0;
+				   }
 
-					   int si = i - dr;
-					   int sj = j - dc;
-					   int second_ij = (si < 0 or si >= second.rows() or
-					                          sj < 0 or sj >= second.cols()
-					                       ? 0
-					                       : second[si][sj]);
+				   // Rows without differing cells add nothing
+				   if (not row_differs and not prev_row_differs)
+					   continue;
 
-					   if (fir[i][j] == second_ij)
+				   for (int j = 0; j < cols; ++j) {
+					   if (prev_row_differs and update_diff_sum(i - 1, j - 2))
+						   return diff_sum;
+
+					   if (not differ_row[j])
 						   continue; // No difference
 
-					   differ[i][j] = 1;
 					   diff_sum += DIFFERING_CELL_PENALTY;
-
-					   diff_orig[i][j] =
-					      prob_pxiel(fir, i, j) - prob_pxiel(second, si, sj);
+					   diff_orig_row[j] =
+					      first_probs(i - MAX_OFFSET, j - MAX_OFFSET) -
+					      prob_pxiel(mask(sec, i - dr, j - dc));
 				   }
 
-				   if (update_diff_sum(i - 1, diff.cols() - 2))
+				   if (update_diff_sum(i - 1, cols - 2))
 					   return diff_sum;
-				   if (update_diff_sum(i - 1, diff.cols() - 1))
+				   if (update_diff_sum(i - 1, cols - 1))
 					   return diff_sum;
+
+				   prev_row_differs = row_differs;
 			   }
 
-			   for (int i = diff.rows() - 1, j = 0; j < diff.cols(); ++j) {
-				   if (update_diff_sum(i, j))
-					   return diff_sum;
+			   if (prev_row_differs) {
+				   for (int j = 0; j < cols; ++j) {
+					   if (update_diff_sum(rows - 1, j))
+						   return diff_sum;
+				   }
 			   }
 
 			   if constexpr (debug) {
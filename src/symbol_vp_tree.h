@@ -0,0 +1,220 @@
+#pragma once
+
+#include "symbol_database.h"
+#include "thread_pool.h"
+#include "untex_img.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <map>
+#include <numeric>
+#include <random>
+#include <utility>
+#include <vector>
+
+// Vantage-point trees over the symbols of a database, one per bucket of
+// symbol sizes, so that only images of similar sizes are ever compared. The
+// distance between two symbols is the greater of their img_diff()s in both
+// directions. It is not a metric: on our databases |d(q, v) - d(s, v)| exceeds
+// d(q, s) for many triples, so subtrees are pruned with a relative slack and
+// the search may still miss the best match -- it is an opt-in alternative to
+// comparing with every symbol, see searches() and visited().
+class SymbolVpTree {
+	struct Node {
+		size_t symbol; // index in SymbolDatabase::symbols()
+		// Symbols in the inside subtree are at most radius away from symbol,
+		// symbols in the outside subtree are at least radius away
+		double radius = 0;
+		int inside = -1, outside = -1;
+	};
+
+	// Sizes of symbols in one bucket differ by at most this - 1
+	static constexpr int BUCKET_SIZE = SYMBOL_SIZE_DIFF_THRESHOLD + 1;
+
+	struct Bucket {
+		int root = -1;
+		std::vector<size_t> symbols;
+	};
+
+	const SymbolDatabase& sdb_;
+	double slack_;
+	std::vector<PixelProbabilities> probs_; // probs_[i] of i-th symbol
+	std::vector<Node> nodes_;
+	// (rows / BUCKET_SIZE, cols / BUCKET_SIZE) => symbols of that size
+	std::map<std::pair<int, int>, Bucket> buckets_;
+
+	mutable std::atomic<size_t> searches_ = 0;
+	mutable std::atomic<size_t> visited_ = 0;
+	mutable std::atomic<size_t> similar_size_ = 0;
+
+public:
+	static constexpr double DEFAULT_SLACK = 0.25;
+
+	// Subtree is pruned only if the triangle inequality proves that it does
+	// not contain a match even with the distance to the vantage point
+	// changed by up to @p slack times itself
+	explicit SymbolVpTree(const SymbolDatabase& sdb,
+	                      double slack = DEFAULT_SLACK)
+	   : sdb_(sdb), slack_(slack) {
+		auto const& symbols = sdb_.symbols();
+		probs_.assign(symbols.size(),
+		              PixelProbabilities(Matrix<double>(0, 0), 0));
+		thread_pool().parallel_for(0, symbols.size(), [&](size_t i) {
+			probs_[i] = sdb_.statistics().pixel_probabilities(symbols[i].img);
+		});
+
+		for (size_t i = 0; i < symbols.size(); ++i)
+			buckets_[bucket_of(symbols[i].img)].symbols.emplace_back(i);
+
+		std::vector<size_t> ids;
+		for (auto& [key, bucket] : buckets_) {
+			// Random vantage points give more balanced trees than the first
+			// symbols which are ordered by their kind
+			ids = bucket.symbols;
+			std::mt19937 rng(ids.size());
+			std::shuffle(ids.begin(), ids.end(), rng);
+			bucket.root = build(ids.begin(), ids.end());
+		}
+	}
+
+	SymbolVpTree(const SymbolVpTree&) = delete;
+	SymbolVpTree& operator=(const SymbolVpTree&) = delete;
+
+	struct Match {
+		const Symbol* symbol; // nullptr if there is no match
+		double diff;
+	};
+
+	// Returns the symbol minimizing img_diff(@p img, symbol) among the symbols
+	// of size similar to @p img (see SYMBOL_SIZE_DIFF_THRESHOLD) with the diff
+	// not greater than @p max_diff. Ties are broken like in the linear scan:
+	// by the position in the database. @p probs has to be
+	// pixel_probabilities(@p img).
+	Match find_best(const Matrix<int>& img,
+	                const PixelProbabilities& probs,
+	                double max_diff) const {
+		Match res {nullptr, max_diff};
+		size_t visited = 0;
+		size_t similar_size = 0;
+		auto [row_bucket, col_bucket] = bucket_of(img);
+		for (int rb = row_bucket - 1; rb <= row_bucket + 1; ++rb) {
+			for (int cb = col_bucket - 1; cb <= col_bucket + 1; ++cb) {
+				auto it = buckets_.find({rb, cb});
+				if (it == buckets_.end())
+					continue;
+
+				for (size_t id : it->second.symbols)
+					similar_size += similar_sizes(img, sdb_.symbols()[id].img);
+				search(it->second.root, img, probs, res, visited);
+			}
+		}
+
+		++searches_;
+		visited_ += visited;
+		similar_size_ += similar_size;
+		return res;
+	}
+
+	size_t searches() const noexcept { return searches_; }
+
+	// Number of symbols compared with, summed over all searches
+	size_t visited() const noexcept { return visited_; }
+
+	// Number of symbols the linear scan would compare with, summed over all
+	// searches
+	size_t linear_scan_visited() const noexcept { return similar_size_; }
+
+private:
+	static std::pair<int, int> bucket_of(const Matrix<int>& img) noexcept {
+		return {img.rows() / BUCKET_SIZE, img.cols() / BUCKET_SIZE};
+	}
+
+	static bool similar_sizes(const Matrix<int>& a,
+	                          const Matrix<int>& b) noexcept {
+		return std::abs(a.rows() - b.rows()) <= SYMBOL_SIZE_DIFF_THRESHOLD and
+		       std::abs(a.cols() - b.cols()) <= SYMBOL_SIZE_DIFF_THRESHOLD;
+	}
+
+	double distance(size_t a, size_t b) const {
+		auto const& symbols = sdb_.symbols();
+		auto const& stats = sdb_.statistics();
+		return std::max(
+		   stats.img_diff(symbols[a].img, probs_[a], symbols[b].img),
+		   stats.img_diff(symbols[b].img, probs_[b], symbols[a].img));
+	}
+
+	template <class Iter>
+	int build(Iter beg, Iter end) {
+		if (beg == end)
+			return -1;
+
+		int id = nodes_.size();
+		nodes_.push_back({*beg, 0, -1, -1});
+		if (++beg == end)
+			return id;
+
+		// Sort the rest by the distance from the vantage point and split them
+		// in halves by the median distance
+		std::vector<std::pair<double, size_t>> dists(end - beg);
+		thread_pool().parallel_for(0, dists.size(), [&](size_t i) {
+			dists[i] = {distance(nodes_[id].symbol, beg[i]), beg[i]};
+		});
+		auto mid = dists.begin() + dists.size() / 2;
+		std::nth_element(dists.begin(), mid, dists.end());
+		for (size_t i = 0; i < dists.size(); ++i)
+			beg[i] = dists[i].second;
+
+		nodes_[id].radius = mid->first;
+		Iter split = beg + (mid - dists.begin());
+		int inside = build(beg, split);
+		int outside = build(split, end);
+		nodes_[id].inside = inside;
+		nodes_[id].outside = outside;
+		return id;
+	}
+
+	void search(int node_id,
+	            const Matrix<int>& img,
+	            const PixelProbabilities& probs,
+	            Match& res,
+	            size_t& visited) const {
+		if (node_id < 0)
+			return;
+
+		const Node& node = nodes_[node_id];
+		auto const& stats = sdb_.statistics();
+		const Symbol& symbol = sdb_.symbols()[node.symbol];
+
+		// Distances above the limit are not needed exactly: the inside
+		// subtree is skipped and the outside one is visited anyway
+		double limit = (node.radius + res.diff) / (1 - slack_);
+		double diff = stats.img_diff(img, probs, symbol.img, limit);
+		double dist = std::max(
+		   diff, stats.img_diff(symbol.img, probs_[node.symbol], img, limit));
+		++visited;
+
+		if (similar_sizes(img, symbol.img) and
+		    (diff < res.diff or
+		     (diff == res.diff and
+		      (not res.symbol or &symbol < res.symbol)))) {
+			res = {&symbol, diff};
+		}
+
+		auto visit_inside = [&] {
+			if (dist * (1 - slack_) - res.diff <= node.radius)
+				search(node.inside, img, probs, res, visited);
+		};
+		auto visit_outside = [&] {
+			if (dist * (1 + slack_) + res.diff >= node.radius)
+				search(node.outside, img, probs, res, visited);
+		};
+		if (dist <= node.radius) {
+			visit_inside();
+			visit_outside();
+		} else {
+			visit_outside();
+			visit_inside();
+		}
+	}
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+// Work-stealing thread pool: every worker has its own deque of tasks, it takes
+// tasks from the back of its own deque and, when it runs out of them, steals
+// from the front of the other workers' deques. Threads waiting for results
+// (wait(), parallel_for(), parallel_reduce()) run queued tasks in the
+// meantime, so nested parallelism does not deadlock.
+class ThreadPool {
+	struct WorkerQueue {
+		std::mutex lock;
+		std::deque<std::function<void()>> tasks;
+	};
+
+	std::vector<std::unique_ptr<WorkerQueue>> queues_;
+	std::vector<std::thread> threads_;
+
+	std::mutex sleep_lock_;
+	std::condition_variable wake_up_;
+	std::atomic<size_t> queued_tasks_ = 0; // incremented under sleep_lock_
+	bool stop_ = false; // guarded by sleep_lock_
+	std::atomic<size_t> next_queue_ = 0;
+
+	// Pool the current thread is a worker of and its queue index
+	inline static thread_local const ThreadPool* current_pool_ = nullptr;
+	inline static thread_local size_t current_queue_ = 0;
+
+public:
+	explicit ThreadPool(
+	   unsigned threads = std::max(std::thread::hardware_concurrency(), 1u)) {
+		threads = std::max(threads, 1u);
+		for (unsigned i = 0; i < threads; ++i)
+			queues_.emplace_back(std::make_unique<WorkerQueue>());
+
+		for (unsigned i = 0; i < threads; ++i)
+			threads_.emplace_back([this, i] { work(i); });
+	}
+
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
+
+	~ThreadPool() {
+		{
+			std::lock_guard<std::mutex> guard(sleep_lock_);
+			stop_ = true;
+		}
+		wake_up_.notify_all();
+		for (auto& thr : threads_)
+			thr.join();
+	}
+
+	size_t size() const noexcept { return threads_.size(); }
+
+	// Schedules @p func to be run by the pool. Tasks still queued when the
+	// pool is destroyed are not run.
+	template <class Func>
+	auto submit(Func&& func) {
+		using Result = std::invoke_result_t<std::decay_t<Func>>;
+		auto task = std::make_shared<std::packaged_task<Result()>>(
+		   std::forward<Func>(func));
+		auto res = task->get_future();
+		push_task([task = std::move(task)] { (*task)(); });
+		return res;
+	}
+
+	// Waits for @p future to be ready running queued tasks in the meantime
+	template <class T>
+	void wait(const std::future<T>& future) {
+		wait_until([&] {
+			return future.wait_for(std::chrono::seconds(0)) ==
+			       std::future_status::ready;
+		});
+	}
+
+	// Calls @p func(i) for each i \in [beg, end). The calling thread takes
+	// part in the work. The first exception thrown by @p func is rethrown.
+	template <class Func>
+	void parallel_for(size_t beg, size_t end, Func&& func) {
+		if (beg >= end)
+			return;
+
+		struct State {
+			std::atomic<size_t> next_chunk = 0;
+			std::atomic<size_t> done_chunks = 0;
+			std::mutex exception_lock;
+			std::exception_ptr exception;
+		};
+
+		const size_t chunks = std::min(end - beg, size() * 4);
+		const size_t chunk_size = (end - beg + chunks - 1) / chunks;
+		auto state = std::make_shared<State>();
+		// Processes chunks until there are none left; @p func is referenced
+		// only while some chunk is in progress i.e. before this function
+		// returns
+		auto process_chunks = [state, chunks, chunk_size, beg, end, &func] {
+			for (size_t ch; (ch = state->next_chunk++) < chunks;) {
+				try {
+					size_t chunk_beg = beg + ch * chunk_size;
+					size_t chunk_end = std::min(chunk_beg + chunk_size, end);
+					for (size_t i = chunk_beg; i < chunk_end; ++i)
+						func(i);
+				} catch (...) {
+					std::lock_guard<std::mutex> guard(state->exception_lock);
+					if (not state->exception)
+						state->exception = std::current_exception();
+				}
+
+				++state->done_chunks;
+			}
+		};
+
+		for (size_t i = 1, helpers = std::min(chunks, size()); i < helpers; ++i)
+			push_task(process_chunks);
+
+		process_chunks();
+		wait_until([&] { return state->done_chunks == chunks; });
+
+		if (state->exception)
+			std::rethrow_exception(state->exception);
+	}
+
+	// Returns reduce(...reduce(reduce(init, p_0), p_1)..., p_k) where p_j is
+	// the result of calling @p func(acc_j, i) for consecutive i in the j-th
+	// range of [beg, end) with acc_j initialized to @p init. The order of
+	// reductions does not depend on the scheduling.
+	template <class T, class Func, class Reduce>
+	T parallel_reduce(size_t beg,
+	                  size_t end,
+	                  const T& init,
+	                  Func&& func,
+	                  Reduce&& reduce) {
+		if (beg >= end)
+			return init;
+
+		const size_t chunks = std::min(end - beg, size() * 4);
+		const size_t chunk_size = (end - beg + chunks - 1) / chunks;
+		std::vector<T> partial(chunks, init);
+		parallel_for(0, chunks, [&](size_t ch) {
+			size_t chunk_end = std::min(beg + (ch + 1) * chunk_size, end);
+			for (size_t i = beg + ch * chunk_size; i < chunk_end; ++i)
+				func(partial[ch], i);
+		});
+
+		T res = init;
+		for (auto& part : partial)
+			res = reduce(std::move(res), std::move(part));
+
+		return res;
+	}
+
+private:
+	void push_task(std::function<void()> task) {
+		size_t qi = (current_pool_ == this
+		                ? current_queue_
+		                : next_queue_++ % queues_.size());
+		{
+			std::lock_guard<std::mutex> guard(queues_[qi]->lock);
+			queues_[qi]->tasks.emplace_back(std::move(task));
+		}
+		{
+			std::lock_guard<std::mutex> guard(sleep_lock_);
+			++queued_tasks_;
+		}
+		wake_up_.notify_one();
+	}
+
+	// Own queue is used as a stack, other queues are stolen from as queues
+	bool try_pop_task(size_t qi, bool own, std::function<void()>& task) {
+		auto& queue = *queues_[qi];
+		std::lock_guard<std::mutex> guard(queue.lock);
+		if (queue.tasks.empty())
+			return false;
+
+		if (own) {
+			task = std::move(queue.tasks.back());
+			queue.tasks.pop_back();
+		} else {
+			task = std::move(queue.tasks.front());
+			queue.tasks.pop_front();
+		}
+
+		--queued_tasks_;
+		return true;
+	}
+
+	// Returns false iff there was no task to run
+	bool try_run_task() {
+		if (queued_tasks_ == 0)
+			return false;
+
+		size_t own = (current_pool_ == this ? current_queue_ : 0);
+		std::function<void()> task;
+		for (size_t k = 0; k < queues_.size(); ++k) {
+			size_t qi = (own + k) % queues_.size();
+			if (try_pop_task(qi, current_pool_ == this and k == 0, task)) {
+				task();
+				return true;
+			}
+		}
+
+		return false;
+	}
+
+	template <class Pred>
+	void wait_until(Pred&& pred) {
+		while (not pred()) {
+			if (not try_run_task())
+				std::this_thread::yield();
+		}
+	}
+
+	void work(size_t qi) {
+		current_pool_ = this;
+		current_queue_ = qi;
+		for (;;) {
+			if (try_run_task())
+				continue;
+
+			std::unique_lock<std::mutex> lock(sleep_lock_);
+			wake_up_.wait(lock, [&] { return queued_tasks_ > 0 or stop_; });
+			if (stop_)
+				return;
+		}
+	}
+};
+
+// Pool shared by the whole program
+inline ThreadPool& thread_pool() {
+	static ThreadPool pool;
+	return pool;
+}
@@ -0,0 +1,162 @@
+#pragma once
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Records Chrome trace events (viewable in chrome://tracing or
+// ui.perfetto.dev). Every thread appends events to its own buffer, so
+// recording does not synchronize threads; the buffers are merged only by
+// write(). While tracing is disabled, TraceScope costs a single load.
+class Trace {
+public:
+	using Clock = std::chrono::steady_clock;
+
+	struct Event {
+		std::string name;
+		const char* category;
+		Clock::time_point begin, end;
+		std::array<std::pair<const char*, long long>, 2> args;
+		int args_num;
+	};
+
+private:
+	struct ThreadBuffer {
+		// Taken only by the owning thread and by write(), so it is uncontended
+		std::mutex lock;
+		int tid;
+		std::vector<Event> events;
+	};
+
+	inline static std::atomic<bool> enabled_ = false;
+	inline static const Clock::time_point start_ = Clock::now();
+	inline static std::mutex buffers_lock_;
+	// Buffers outlive their threads, so events of the threads that have
+	// already exited are written too
+	inline static std::vector<std::unique_ptr<ThreadBuffer>> buffers_;
+
+	static ThreadBuffer& thread_buffer() {
+		thread_local ThreadBuffer* buffer = [] {
+			std::lock_guard<std::mutex> guard(buffers_lock_);
+			auto& buff = buffers_.emplace_back(std::make_unique<ThreadBuffer>());
+			buff->tid = buffers_.size();
+			return buff.get();
+		}();
+		return *buffer;
+	}
+
+	static void write_escaped(FILE* file, std::string_view str) {
+		for (char c : str) {
+			if (c == '"' or c == '\\')
+				fprintf(file, "\\%c", c);
+			else if ((unsigned char)c < 0x20)
+				fprintf(file, "\\u%04x", c);
+			else
+				putc(c, file);
+		}
+	}
+
+public:
+	static bool enabled() noexcept {
+		return enabled_.load(std::memory_order_relaxed);
+	}
+
+	static void enable() noexcept { enabled_ = true; }
+
+	static void record(Event event) {
+		auto& buffer = thread_buffer();
+		std::lock_guard<std::mutex> guard(buffer.lock);
+		buffer.events.emplace_back(std::move(event));
+	}
+
+	// Writes all events recorded so far to @p filename as trace event JSON
+	static void write(const std::string& filename) {
+		FILE* file = fopen(filename.c_str(), "w");
+		if (not file)
+			throw std::runtime_error("Failed to open trace file " + filename);
+
+		auto micros = [](Clock::duration dur) {
+			return std::chrono::duration<double, std::micro>(dur).count();
+		};
+		fputs("{\"traceEvents\":[", file);
+		bool first = true;
+		std::lock_guard<std::mutex> guard(buffers_lock_);
+		for (auto& buffer : buffers_) {
+			std::lock_guard<std::mutex> buffer_guard(buffer->lock);
+			for (auto const& event : buffer->events) {
+				fputs(first ? "\n{\"name\":\"" : ",\n{\"name\":\"", file);
+				first = false;
+				write_escaped(file, event.name);
+				fprintf(file,
+				        "\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,"
+				        "\"dur\":%.3f,\"pid\":1,\"tid\":%i,\"args\":{",
+				        event.category,
+				        micros(event.begin - start_),
+				        micros(event.end - event.begin),
+				        buffer->tid);
+				for (int i = 0; i < event.args_num; ++i) {
+					fprintf(file,
+					        "%s\"%s\":%lli",
+					        (i > 0 ? "," : ""),
+					        event.args[i].first,
+					        event.args[i].second);
+				}
+				fputs("}}", file);
+			}
+		}
+
+		fputs("\n]}\n", file);
+		if (fclose(file) != 0)
+			throw std::runtime_error("Failed to write trace file " + filename);
+	}
+};
+
+// Records an event lasting from the construction till the destruction of the
+// object, with up to two integer arguments
+class TraceScope {
+	std::optional<Trace::Event> event_; // empty if tracing is disabled
+
+public:
+	template <class... Args>
+	TraceScope(std::string_view name, const char* category, Args... args) {
+		static_assert(sizeof...(args) <= 4 and sizeof...(args) % 2 == 0);
+		if (not Trace::enabled())
+			return;
+
+		event_.emplace(Trace::Event {
+		   std::string(name), category, Trace::Clock::now(), {}, {}, 0});
+		set_args(args...);
+	}
+
+	TraceScope(const TraceScope&) = delete;
+	TraceScope& operator=(const TraceScope&) = delete;
+
+	~TraceScope() {
+		if (not event_)
+			return;
+
+		event_->end = Trace::Clock::now();
+		try {
+			Trace::record(std::move(*event_));
+		} catch (...) {
+		}
+	}
+
+private:
+	void set_args() noexcept {}
+
+	template <class... Args>
+	void set_args(const char* name, long long value, Args... args) noexcept {
+		event_->args[event_->args_num++] = {name, value};
+		set_args(args...);
+	}
+};
@@ -1,13 +1,16 @@
 #include "symbol_database.h"
+#include "thread_pool.h"
+#include <cstring>
 #include <dirent.h>
 #include <filesystem>
+#include <unordered_map>
 
 using std::cerr;
 using std::endl;
-using std::map;
 using std::pair;
 using std::string;
 using std::to_string;
+using std::vector;
 
 template <class Func, class ErrFunc>
 static void for_each_dir_component(DIR* dir, Func&& func, ErrFunc&& readdir_failed) {
@@ -28,6 +31,16 @@ static void for_each_dir_component(DIR* dir, Func&& func, ErrFunc&& readdir_fail
 	}
 }
 
+// Decodes images in parallel, res[i] is the image from paths[i]
+static vector<Matrix<int>> decode_images(const vector<string>& paths) {
+	vector<Matrix<int>> res(paths.size(), Matrix<int>(0, 0));
+	thread_pool().parallel_for(0, paths.size(), [&](size_t i) {
+		res[i] = teximg_to_matrix(paths[i].data());
+	});
+
+	return res;
+}
+
 static void unique_files_from_full_main_to_main(string src_dir,
                                          string dest_dir) {
 	if (not src_dir.empty() and src_dir.back() != '/')
@@ -35,33 +48,39 @@ static void unique_files_from_full_main_to_main(string src_dir,
 	if (not dest_dir.empty() and dest_dir.back() != '/')
 		dest_dir += '/';
 
-	auto cmp = [](const Matrix<int>& a, const Matrix<int>& b) {
-		return pair(a.rows() * a.cols(),
-		            SymbolDatabase::symbol_to_text_img(a)) <
-		       pair(b.rows() * b.cols(), SymbolDatabase::symbol_to_text_img(b));
-	};
-
-	map<Matrix<int>, string, decltype(cmp)> images(std::move(cmp));
+	vector<string> paths;
 	for_each_dir_component(
 	   opendir(src_dir.c_str()),
-	   [&](dirent* file) {
-		   string path = src_dir + file->d_name;
-
-		   auto img = teximg_to_matrix(path.data());
-		   auto& mapped = images[img];
-		   if (mapped.empty())
-			   mapped = path;
-	   },
+	   [&](dirent* file) { paths.emplace_back(src_dir + file->d_name); },
 	   [] { throw std::runtime_error("readdir() failed"); });
+	// Sort to make choosing the path of duplicated images deterministic
+	sort(paths.begin(), paths.end());
+
+	auto images = decode_images(paths);
+
+	// Image => index of the first path containing it
+	std::unordered_map<Matrix<int>, size_t> unique_images;
+	for (size_t i = 0; i < images.size(); ++i)
+		unique_images.emplace(std::move(images[i]), i);
+
+	// Order files by size and then by their text representation
+	vector<pair<pair<int, string>, size_t>> order;
+	order.reserve(unique_images.size());
+	for (auto const& [img, path_idx] : unique_images) {
+		order.push_back({{img.rows() * img.cols(),
+		                  SymbolDatabase::symbol_to_text_img(img)},
+		                 path_idx});
+	}
+	sort(order.begin(), order.end());
 
-	cerr << images.size() << endl;
+	cerr << order.size() << endl;
 
 	namespace fs = std::filesystem;
 	fs::remove_all(dest_dir);
 	(void)fs::create_directory(dest_dir);
 	int i = 0;
-	for (auto const& [symbol, path_str] : images) {
-		fs::path path = path_str;
+	for (auto const& [key, path_idx] : order) {
+		fs::path path = paths[path_idx];
 		if (not fs::copy_file(
 		       path, fs::path(dest_dir) += to_string(++i) += path.extension())) {
 			throw std::runtime_error("file copy failed");
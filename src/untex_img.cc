@@ -1,8 +1,14 @@
 #include "untex_img.h"
 #include "improve_tex.h"
+#include "log.h"
 #include "symbol_database.h"
+#include "symbol_vp_tree.h"
+#include "thread_pool.h"
+#include "trace.h"
 #include "utilities.h"
 
+#include <iterator>
+
 using std::array;
 using std::fixed;
 using std::max;
@@ -18,12 +24,15 @@ using std::vector;
 
 namespace {
 
-constexpr bool debug = false;
-
 class ImgUntexer {
 	static constexpr int SYMBOL_GROUPS_NO = 13;
-	static constexpr double MATCH_THRESHOLD = 1.4;
-	static constexpr int SIZE_DIFF_THRESHOLD = 4;
+	// Number of arena images compared with all candidates at once, see
+	// match_cells(). It matters only once the arena outgrows the cache, and
+	// even then little, as comparing images costs far more than loading them.
+	static constexpr size_t ARENA_BLOCK = 64;
+	// Number of DP positions whose candidates are matched at once, see
+	// match_symbols()
+	static constexpr int MATCH_LOOKAHEAD = 16;
 
 	struct MatchedSymbol {
 		int orig_symbol_group;
@@ -31,6 +40,11 @@ class ImgUntexer {
 		string matched_symbol_tex;
 	};
 
+	struct Match {
+		const Symbol* symbol; // nullptr if there is no match
+		double diff;
+	};
+
 	struct PossibleDpState {
 		double best_cumulative_diff = numeric_limits<double>::max();
 		MatchedSymbol last_symbol;
@@ -38,41 +52,67 @@ class ImgUntexer {
 
 	Matrix<int> orignal_image_;
 	const SymbolDatabase& symbols_db_;
-	bool be_verbose_;
+	Segmentation segmentation_;
+	const SymbolVpTree* symbol_index_; // nullptr => scan the whole database
+	MatchThresholds thresholds_;
+	// If set, matches are taken from it instead of comparing with database
+	optional<RecordedMatchesView> recorded_;
+	// If set, matches are computed ahead of the DP in parallel, see
+	// match_candidates(), and stored in precomputed_ in the order the DP
+	// visits the candidates
+	bool match_ahead_ = false;
+	vector<Match> precomputed_;
 	array<vector<SplitSymbol>, SYMBOL_GROUPS_NO> symbol_groups_;
 	vector<optional<PossibleDpState>> dp_;
 
-	template <class... Args>
-	void verbose_log(Args&&... args) {
-		if (be_verbose_)
-			(std::cerr << ... << std::forward<Args>(args));
-	}
-
 public:
 	ImgUntexer(Matrix<int> image,
 	           const SymbolDatabase& symbol_database,
-	           bool be_verbose = false)
+	           Segmentation segmentation = Segmentation::EMPTY_COLUMNS,
+	           const SymbolVpTree* symbol_index = nullptr)
 	   : orignal_image_(std::move(image)), symbols_db_(symbol_database),
-	     be_verbose_(be_verbose) {}
+	     segmentation_(segmentation), symbol_index_(symbol_index) {}
 
 private:
 	void split_into_symbol_groups() {
-		symbol_groups_ =
-		   ::split_into_symbol_groups<SYMBOL_GROUPS_NO>(orignal_image_);
+		TraceScope trace("segmentation", "untex");
+		switch (segmentation_) {
+		case Segmentation::EMPTY_COLUMNS:
+			symbol_groups_ =
+			   ::split_into_symbol_groups<SYMBOL_GROUPS_NO>(orignal_image_);
+			break;
+		case Segmentation::CONNECTED_COMPONENTS:
+			symbol_groups_ =
+			   split_into_symbol_groups_by_components<SYMBOL_GROUPS_NO>(
+			      orignal_image_);
+			break;
+		}
 
-		if constexpr (debug) {
-			show_matrix(orignal_image_);
-			binshow_matrix(orignal_image_);
+		if (Log::enabled<LogLevel::TRACE>()) {
+			log_trace(orignal_image_);
 			for (size_t i = 0; i < symbol_groups_.size(); ++i) {
-				verbose_log("symbol_groups_[", i, "]:\n");
+				log_trace("symbol_groups_[", i, "]:");
 				for (auto&& symbol : symbol_groups_[i])
-					binshow_matrix(symbol.img);
+					log_trace(symbol.img);
 			}
 		}
 	}
 
 	bool dp_possible(int pos) const noexcept { return dp_[pos].has_value(); }
 
+	// Number of symbol candidates the DP visits before position @p pos
+	static size_t candidates_before(int pos) noexcept {
+		constexpr size_t G = SYMBOL_GROUPS_NO;
+		if (size_t(pos) <= G)
+			return size_t(pos) * (pos + 1) / 2;
+
+		return G * (G + 1) / 2 + (pos - G) * G;
+	}
+
+	size_t candidates_num() const noexcept {
+		return candidates_before(symbol_groups_[0].size());
+	}
+
 	bool cannot_match(int pos) const noexcept {
 		if (dp_possible(pos))
 			return false;
@@ -100,39 +140,42 @@ private:
 
 		dp_.clear();
 		dp_.resize(n);
+		if (match_ahead_)
+			precomputed_.assign(candidates_num(), {nullptr, 0});
 
 		for (int pos = 0; pos < n; ++pos) {
-			verbose_log("\nSYMBOL No. ", pos, ":\n");
+			// Only combining matches into DP states is sequential
+			if (match_ahead_ and pos % MATCH_LOOKAHEAD == 0)
+				match_candidates(pos, min(pos + MATCH_LOOKAHEAD, n));
+
+			log_debug("\nSYMBOL No. ", pos, ':');
 			for (int gr = 0; gr < min<int>(pos + 1, symbol_groups_.size());
 			     ++gr) {
 				dp_try_to_match_symbol(pos, gr);
 			}
 
-			if (cannot_match(pos)) {
-				verbose_log('\n');
+			if (cannot_match(pos))
 				return collect_unmatched_symbol_candidates(pos);
-			}
 		}
 
 		return dp_collect_only_used_symbols();
 	}
 
 	vector<MatchedSymbol> dp_collect_only_used_symbols() {
-		if constexpr (debug) {
+		if (Log::enabled<LogLevel::TRACE>()) {
 			int pos = -1;
 			for (auto& opt : dp_) {
 				++pos;
 				if (not opt.has_value())
 					continue;
 
-				verbose_log(pos,
-				            ": ",
-				            opt->last_symbol.matched_symbol_tex,
-				            " with cum_diff: ",
-				            fixed,
-				            setprecision(6),
-				            opt->best_cumulative_diff,
-				            '\n');
+				log_trace(pos,
+				          ": ",
+				          opt->last_symbol.matched_symbol_tex,
+				          " with cum_diff: ",
+				          fixed,
+				          setprecision(6),
+				          opt->best_cumulative_diff);
 			}
 		}
 
@@ -156,47 +199,30 @@ private:
 		if (pos > symbol_group and not dp_possible(pos - symbol_group - 1))
 			return;
 
+		TraceScope trace("dp", "untex", "pos", pos, "group", symbol_group);
+
 		const SplitSymbol& curr_symbol =
 		   symbol_groups_[symbol_group][pos - symbol_group];
 
-		double best_diff = numeric_limits<double>::max();
-		const Symbol* best_symbol = nullptr;
-		// Find best matching symbol
-		for (Symbol const& symbol : symbols_db_.symbols()) {
-			if (abs(curr_symbol.img.cols() - symbol.img.cols()) >
-			       SIZE_DIFF_THRESHOLD or
-			    abs(curr_symbol.img.rows() - symbol.img.rows()) >
-			       SIZE_DIFF_THRESHOLD) {
-				continue;
-			}
-
-			double diff = symbols_db_.statistics().img_diff(
-			   curr_symbol.img, symbol.img, min(best_diff, MATCH_THRESHOLD));
-			if (diff < best_diff) {
-				best_diff = diff;
-				best_symbol = &symbol;
-			}
-		}
-
+		auto [best_symbol, best_diff] = best_match(pos, symbol_group);
 		if (not best_symbol)
 			return;
 
 		string best_symbol_tex =
 		   matched_symbol_to_tex(curr_symbol, *best_symbol);
-		if (best_diff <= MATCH_THRESHOLD) {
-			verbose_log("\033[1;32mMatched as group ",
-			            symbol_group,
-			            ":\033[m ",
-			            best_symbol_tex,
-			            " with diff: ",
-			            setprecision(6),
-			            fixed,
-			            best_diff,
-			            '\n');
-			if (be_verbose_) {
-				binshow_matrix(curr_symbol.img);
-				binshow_matrix(best_symbol->img);
-			}
+		if (best_diff <= thresholds_.match) {
+			log_debug("\033[1;32mMatched as group ",
+			          symbol_group,
+			          ":\033[m ",
+			          best_symbol_tex,
+			          " with diff: ",
+			          setprecision(6),
+			          fixed,
+			          best_diff,
+			          '\n',
+			          curr_symbol.img,
+			          '\n',
+			          best_symbol->img);
 
 			double curr_cum_diff =
 			   (pos == symbol_group
@@ -212,17 +238,288 @@ private:
 				   {symbol_group, curr_symbol, best_symbol_tex}});
 			}
 
-		} else if constexpr (debug) {
-			verbose_log("\033[33mBest match as group ",
-			            symbol_group,
-			            ":\033[m ",
-			            best_symbol_tex,
-			            " with diff: ",
-			            setprecision(6),
-			            fixed,
-			            best_diff,
-			            '\n');
+		} else {
+			log_trace("\033[33mBest match as group ",
+			          symbol_group,
+			          ":\033[m ",
+			          best_symbol_tex,
+			          " with diff: ",
+			          setprecision(6),
+			          fixed,
+			          best_diff);
+		}
+	}
+
+	Match best_match(int pos, int symbol_group) const {
+		if (recorded_)
+			return recorded_match(pos, symbol_group);
+		if (match_ahead_)
+			return precomputed_[candidates_before(pos) + symbol_group];
+
+		return find_best_match(
+		   symbol_groups_[symbol_group][pos - symbol_group]);
+	}
+
+	Match find_best_match(const SplitSymbol& curr_symbol) const {
+		double best_diff = numeric_limits<double>::max();
+		const Symbol* best_symbol =
+		   find_unambiguous_identical_symbol(curr_symbol);
+		if (best_symbol) {
+			best_diff = 0; // No need to scan the whole database
+		} else if (symbol_index_) {
+			TraceScope trace("vp-tree search", "untex");
+			auto match = symbol_index_->find_best(
+			   curr_symbol.img,
+			   symbols_db_.statistics().pixel_probabilities(curr_symbol.img),
+			   thresholds_.match);
+			best_symbol = match.symbol;
+			best_diff = match.diff;
+		} else {
+			TraceScope trace("database scan", "untex");
+			return scan_arena(curr_symbol);
+		}
+
+		return {best_symbol, best_diff};
+	}
+
+	// Symbol candidate being compared with the arena images
+	struct ArenaQuery {
+		const Matrix<int>* img;
+		PixelProbabilities probs;
+		vector<SymbolArena::RowBits> bits;
+		bool has_bits;
+		Match best {nullptr, numeric_limits<double>::max()};
+		size_t best_id = 0; // index of best.symbol in symbols()
+	};
+
+	ArenaQuery arena_query(const SplitSymbol& curr_symbol) const {
+		auto const& img = curr_symbol.img;
+		ArenaQuery res {
+		   &img, symbols_db_.statistics().pixel_probabilities(img), {}, false};
+		res.has_bits = SymbolStatistics::to_row_bits(img, res.bits);
+		return res;
+	}
+
+	// Compares @p query with the i-th arena image unless they differ too much
+	// in size. Values of img_diff() not greater than the threshold do not
+	// depend on it, and ties are broken by the index in symbols(), so the
+	// best match does not depend on the order of comparisons and is the same
+	// as of comparing with the symbols in the database order.
+	void compare_with_arena(ArenaQuery& query, size_t i) const {
+		auto const& arena = symbols_db_.arena();
+		if (abs(arena.rows(i) - query.img->rows()) > thresholds_.size_diff or
+		    abs(arena.cols(i) - query.img->cols()) > thresholds_.size_diff) {
+			return;
+		}
+
+		auto const& stats = symbols_db_.statistics();
+		size_t id = arena.symbol_id(i);
+		double threshold = min(query.best.diff, thresholds_.match);
+		optional<double> diff;
+		if (query.has_bits and arena.bits(i)) {
+			diff = stats.bitboard_img_diff(query.bits.data(),
+			                               query.img->rows(),
+			                               query.img->cols(),
+			                               query.probs,
+			                               arena.bits(i),
+			                               arena.rows(i),
+			                               arena.cols(i),
+			                               threshold);
+		}
+		if (not diff) {
+			diff = stats.img_diff(*query.img,
+			                      query.probs,
+			                      symbols_db_.symbols()[id].img,
+			                      threshold);
+		}
+
+		if (*diff < query.best.diff or
+		    (*diff == query.best.diff and id < query.best_id)) {
+			query.best = {&symbols_db_.symbols()[id], *diff};
+			query.best_id = id;
+		}
+	}
+
+	// Scans the symbols of similar size in the (rows, cols) order of the arena
+	Match scan_arena(const SplitSymbol& curr_symbol) const {
+		auto query = arena_query(curr_symbol);
+		auto [beg, end] = symbols_db_.arena().rows_range(
+		   curr_symbol.img.rows() - thresholds_.size_diff,
+		   curr_symbol.img.rows() + thresholds_.size_diff);
+		for (size_t i = beg; i < end; ++i)
+			compare_with_arena(query, i);
+
+		return query.best;
+	}
+
+	struct Cell {
+		size_t candidate; // index in precomputed_
+		const SplitSymbol* symbol;
+	};
+
+	// Fills precomputed_ for the candidates at positions [beg_pos, end_pos)
+	// the DP may visit: ones following a position the DP has already found
+	// unmatchable are skipped, ones following a position it has not reached
+	// yet are matched speculatively. The candidates are ordered by size and
+	// split into tasks run in parallel.
+	void match_candidates(int beg_pos, int end_pos) {
+		TraceScope trace("match candidates", "untex", "pos", beg_pos);
+		vector<Cell> cells;
+		for (int pos = beg_pos; pos < end_pos; ++pos) {
+			for (int gr = 0; gr < min<int>(pos + 1, symbol_groups_.size());
+			     ++gr) {
+				int prev = pos - gr - 1;
+				if (prev >= 0 and prev < beg_pos and not dp_possible(prev))
+					continue;
+
+				cells.push_back({candidates_before(pos) + gr,
+				                 &symbol_groups_[gr][pos - gr]});
+			}
+		}
+
+		std::stable_sort(cells.begin(), cells.end(), [](auto& a, auto& b) {
+			return a.symbol->img.rows() < b.symbol->img.rows();
+		});
+		const size_t tasks = min(cells.size(), thread_pool().size() * 4);
+		thread_pool().parallel_for(0, tasks, [&](size_t t) {
+			match_cells(cells.data() + cells.size() * t / tasks,
+			            cells.data() + cells.size() * (t + 1) / tasks);
+		});
+	}
+
+	// Matches the cells [@p beg, @p end) ordered by rows. Instead of scanning
+	// the arena once per cell, every block of ARENA_BLOCK arena images is
+	// compared with all the cells of a compatible size while the block is in
+	// cache.
+	void match_cells(const Cell* beg, const Cell* end) {
+		vector<std::pair<size_t, ArenaQuery>> queries; // (candidate, query)
+		for (auto cell = beg; cell != end; ++cell) {
+			auto symbol = find_unambiguous_identical_symbol(*cell->symbol);
+			if (symbol) {
+				precomputed_[cell->candidate] = {symbol, 0};
+			} else {
+				queries.emplace_back(cell->candidate,
+				                     arena_query(*cell->symbol));
+			}
+		}
+		if (queries.empty())
+			return;
+
+		auto const& arena = symbols_db_.arena();
+		auto [arena_beg, arena_end] = arena.rows_range(
+		   queries.front().second.img->rows() - thresholds_.size_diff,
+		   queries.back().second.img->rows() + thresholds_.size_diff);
+		for (size_t beg = arena_beg; beg < arena_end; beg += ARENA_BLOCK) {
+			size_t end = min(beg + ARENA_BLOCK, arena_end);
+			// Arena images are ordered by rows
+			int min_rows = arena.rows(beg) - thresholds_.size_diff;
+			int max_rows = arena.rows(end - 1) + thresholds_.size_diff;
+			auto first = std::partition_point(
+			   queries.begin(), queries.end(), [&](auto& query) {
+				   return query.second.img->rows() < min_rows;
+			   });
+			for (auto it = first;
+			     it != queries.end() and it->second.img->rows() <= max_rows;
+			     ++it) {
+				for (size_t i = beg; i < end; ++i)
+					compare_with_arena(it->second, i);
+			}
+		}
+
+		for (auto const& [cand, query] : queries)
+			precomputed_[cand] = query.best;
+	}
+
+	Match recorded_match(int pos, int symbol_group) const noexcept {
+		size_t cand = candidates_before(pos) + symbol_group;
+		const RecordedMatch* beg = recorded_->matches + recorded_->begins[cand];
+		const RecordedMatch* end =
+		   recorded_->matches + recorded_->begins[cand + 1];
+		Match res {nullptr, numeric_limits<double>::max()};
+		// Later matches are better but allow greater size differences
+		for (auto it = beg; it != end and
+		                    int(it->size_diff) <= thresholds_.size_diff;
+		     ++it) {
+			res = {&symbols_db_.symbols()[it->symbol], it->diff};
+		}
+
+		return res;
+	}
+
+	static int size_diff(const Matrix<int>& a, const Matrix<int>& b) noexcept {
+		return max(abs(a.rows() - b.rows()), abs(a.cols() - b.cols()));
+	}
+
+	// Appends the matches of @p curr_symbol to @p res. Comparing with symbols
+	// in the database order and keeping only strictly better matches breaks
+	// ties like find_best_match() does.
+	void record_matches(const SplitSymbol& curr_symbol,
+	                    MatchThresholds max_thresholds,
+	                    RecordedMatches& res) const {
+		if (auto symbol = find_unambiguous_identical_symbol(curr_symbol)) {
+			// It is matched regardless of the thresholds
+			res.matches.push_back(
+			   {0, uint32_t(symbol - symbols_db_.symbols().data()), 0});
+			return;
+		}
+
+		auto const& stats = symbols_db_.statistics();
+		auto curr_symbol_probs = stats.pixel_probabilities(curr_symbol.img);
+		// best[d] is the best match among the symbols differing in size by d
+		vector<Match> best(max_thresholds.size_diff + 1,
+		                   Match {nullptr, numeric_limits<double>::max()});
+		for (Symbol const& symbol : symbols_db_.symbols()) {
+			int sd = size_diff(curr_symbol.img, symbol.img);
+			if (sd > max_thresholds.size_diff)
+				continue;
+
+			// Matches worse than the best one with the size difference at most
+			// sd are never chosen
+			double limit = numeric_limits<double>::max();
+			for (int d = 0; d <= sd; ++d)
+				limit = min(limit, best[d].diff);
+
+			double diff = stats.img_diff(curr_symbol.img,
+			                             curr_symbol_probs,
+			                             symbol.img,
+			                             min(limit, max_thresholds.match));
+			if (diff < limit and diff <= max_thresholds.match)
+				best[sd] = {&symbol, diff};
+		}
+
+		const Match* prev = nullptr;
+		for (int d = 0; d <= max_thresholds.size_diff; ++d) {
+			const Match& curr = best[d];
+			if (not curr.symbol)
+				continue;
+
+			if (not prev or curr.diff < prev->diff or
+			    (curr.diff == prev->diff and curr.symbol < prev->symbol)) {
+				res.matches.push_back(
+				   {curr.diff,
+				    uint32_t(curr.symbol - symbols_db_.symbols().data()),
+				    uint32_t(d)});
+				prev = &curr;
+			}
+		}
+	}
+
+	// Returns the database symbol with image identical to @p symbol's, but only
+	// if all such symbols have the same tex, nullptr otherwise
+	const Symbol*
+	find_unambiguous_identical_symbol(const SplitSymbol& symbol) const {
+		auto ids = symbols_db_.identical_symbols(symbol.img);
+		if (ids.empty())
+			return nullptr;
+
+		auto const& db_symbols = symbols_db_.symbols();
+		const Symbol& res = db_symbols[ids[0]];
+		for (size_t id : ids) {
+			if (db_symbols[id].tex != res.tex)
+				return nullptr;
 		}
+
+		return &res;
 	}
 
 	static string matched_symbol_to_tex(const SplitSymbol& current_symbol,
@@ -282,10 +579,7 @@ private:
 		return res;
 	}
 
-public:
-	variant<string, UntexFailure> untex() {
-		split_into_symbol_groups();
-
+	variant<string, UntexFailure> untex_symbol_groups() {
 		using ResType = variant<string, UntexFailure>;
 		return std::visit(
 		   overloaded {[](UntexFailure failure) { return ResType(failure); },
@@ -298,16 +592,61 @@ public:
 				               tex += ' ';
 			               }
 
-			               if constexpr (debug)
-				               verbose_log(tex, '\n');
+			               log_trace(tex);
 
 			               assert(not tex.empty());
 			               tex.pop_back(); // Remove trailing space
+			               TraceScope trace("improve_tex", "untex");
 			               return ResType(improve_tex(tex));
 		               }},
 		   match_symbols());
 	}
 
+public:
+	variant<string, UntexFailure> untex() {
+		split_into_symbol_groups();
+		match_ahead_ = (symbol_index_ == nullptr);
+		return untex_symbol_groups();
+	}
+
+	// Appends matches of all symbol candidates to @p res, see
+	// ::record_matches()
+	void record(MatchThresholds max_thresholds, RecordedMatches& res) {
+		split_into_symbol_groups();
+		const int n = symbol_groups_[0].size();
+		for (int pos = 0; pos < n; ++pos) {
+			for (int gr = 0; gr < min<int>(pos + 1, symbol_groups_.size());
+			     ++gr) {
+				TraceScope trace("record", "sweep", "pos", pos, "group", gr);
+				record_matches(
+				   symbol_groups_[gr][pos - gr], max_thresholds, res);
+				res.begins.emplace_back(res.matches.size());
+			}
+		}
+	}
+
+	// Untexes the image with every of @p thresholds using matches of the
+	// first candidates of @p recorded. Returns the results and the number of
+	// the candidates used.
+	std::pair<vector<variant<string, UntexFailure>>, size_t>
+	replay(RecordedMatchesView recorded,
+	       const vector<MatchThresholds>& thresholds) {
+		split_into_symbol_groups();
+		if (candidates_num() > recorded.pairs) {
+			throw std::runtime_error(
+			   "Recorded matches do not correspond to the image");
+		}
+
+		recorded_ = recorded;
+		vector<variant<string, UntexFailure>> res;
+		for (auto const& thr : thresholds) {
+			thresholds_ = thr;
+			res.emplace_back(untex_symbol_groups());
+		}
+
+		return {std::move(res), candidates_num()};
+	}
+
 private:
 	static void
 	correct_matched_symbols_using_baseline(vector<MatchedSymbol>& symbols) {
@@ -374,10 +713,11 @@ private:
 			int min_spacing = min(left_spacing, right_spacing);
 			auto& symbol = symbols[i];
 
-			if constexpr (debug) {
-				std::cerr << left_spacing << "   " << symbol.matched_symbol_tex
-				          << "   " << right_spacing << '\n';
-			}
+			log_trace(left_spacing,
+			          "   ",
+			          symbol.matched_symbol_tex,
+			          "   ",
+			          right_spacing);
 
 			if (symbol.matched_symbol_tex == "|" and min_spacing > 6)
 				symbol.matched_symbol_tex = "\\mid";
@@ -595,10 +935,138 @@ private:
 	}
 };
 
+// Lines of a multi-line image are separated by at least that many empty rows.
+// It is more than any gap inside a single line e.g. in a fraction or between
+// the dot and the stem of "i".
+constexpr int MIN_LINE_GAP = 10;
+
+// Returns the ranges [beg, end) of rows of the lines of @p img
+vector<std::pair<int, int>> split_into_lines(const Matrix<int>& img) {
+	vector<std::pair<int, int>> lines;
+	int beg = 0;
+	int empty_rows = 0;
+	for (int r = 0; r < img.rows(); ++r) {
+		auto row = img.row(r);
+		if (std::none_of(row.begin(), row.end(), [](int x) { return x; })) {
+			++empty_rows;
+			continue;
+		}
+
+		if (empty_rows >= MIN_LINE_GAP and r - empty_rows > beg) {
+			lines.emplace_back(beg, r - empty_rows);
+			beg = r;
+		}
+		empty_rows = 0;
+	}
+
+	lines.emplace_back(beg, img.rows());
+	return lines;
+}
+
+Matrix<int> line_img(const Matrix<int>& img, std::pair<int, int> line) {
+	auto [beg, end] = line;
+	return SubmatrixView<int>(img, beg, 0, end - beg, img.cols()).to_matrix();
+}
+
+// Joins results of untexing lines of an image into the result for the image
+variant<string, UntexFailure>
+join_lines(vector<variant<string, UntexFailure>> results) {
+	UntexFailure failure;
+	bool failed = false;
+	string tex = "\\begin{gathered}";
+	for (size_t i = 0; i < results.size(); ++i) {
+		if (auto* line_failure = std::get_if<UntexFailure>(&results[i])) {
+			auto& candidates = line_failure->unmatched_symbol_candidates;
+			std::move(candidates.begin(),
+			          candidates.end(),
+			          std::back_inserter(failure.unmatched_symbol_candidates));
+			failed = true;
+			continue;
+		}
+
+		tex += (i == 0 ? " " : " \\\\ ");
+		tex += std::get<string>(results[i]);
+	}
+
+	if (failed)
+		return failure;
+
+	return tex + " \\end{gathered}";
+}
+
 } // namespace
 
 variant<string, UntexFailure> untex_img(const Matrix<int>& img,
                                         const SymbolDatabase& symbol_database,
-                                        bool be_verbose) {
-	return ImgUntexer(img, symbol_database, be_verbose).untex();
+                                        Segmentation segmentation,
+                                        const SymbolVpTree* symbol_index) {
+	auto lines = split_into_lines(img);
+	if (lines.size() == 1) {
+		return ImgUntexer(img, symbol_database, segmentation, symbol_index)
+		   .untex();
+	}
+
+	// Lines are independent, so they are untexed in parallel
+	log_debug("Untexing ", lines.size(), " lines separately");
+
+	vector<variant<string, UntexFailure>> results(lines.size());
+	thread_pool().parallel_for(0, lines.size(), [&](size_t i) {
+		TraceScope trace("line", "untex", "line", i);
+		results[i] = ImgUntexer(line_img(img, lines[i]),
+		                        symbol_database,
+		                        segmentation,
+		                        symbol_index)
+		                .untex();
+	});
+
+	return join_lines(std::move(results));
+}
+
+RecordedMatches record_matches(const Matrix<int>& img,
+                               const SymbolDatabase& symbol_database,
+                               Segmentation segmentation,
+                               MatchThresholds max) {
+	RecordedMatches res;
+	for (auto line : split_into_lines(img)) {
+		ImgUntexer(line_img(img, line), symbol_database, segmentation)
+		   .record(max, res);
+	}
+
+	return res;
+}
+
+vector<variant<string, UntexFailure>>
+replay_untex(const Matrix<int>& img,
+             const SymbolDatabase& symbol_database,
+             Segmentation segmentation,
+             RecordedMatchesView recorded,
+             const vector<MatchThresholds>& thresholds) {
+	auto lines = split_into_lines(img);
+	// lines_results[i][j] is the result of the j-th line with thresholds[i]
+	vector<vector<variant<string, UntexFailure>>> lines_results(
+	   thresholds.size());
+	for (auto line : lines) {
+		auto [results, used] =
+		   ImgUntexer(line_img(img, line), symbol_database, segmentation)
+		      .replay(recorded, thresholds);
+		recorded.begins += used;
+		recorded.pairs -= used;
+		for (size_t i = 0; i < thresholds.size(); ++i)
+			lines_results[i].emplace_back(std::move(results[i]));
+	}
+
+	if (recorded.pairs != 0) {
+		throw std::runtime_error(
+		   "Recorded matches do not correspond to the image");
+	}
+
+	vector<variant<string, UntexFailure>> res;
+	for (auto& results : lines_results) {
+		if (lines.size() == 1)
+			res.emplace_back(std::move(results[0]));
+		else
+			res.emplace_back(join_lines(std::move(results)));
+	}
+
+	return res;
 }
@@ -2,15 +2,82 @@
 
 #include "symbol_database.h"
 
+#include <cstdint>
 #include <string>
 #include <variant>
 #include <vector>
 
+class SymbolVpTree;
+
 struct UntexFailure {
 	std::vector<SplitSymbol> unmatched_symbol_candidates;
 };
 
+// Images of symbols that differ more than this in width or height are never
+// matched with each other
+constexpr int SYMBOL_SIZE_DIFF_THRESHOLD = 4;
+
+// Symbols are matched only if their img_diff() is at most this
+constexpr double SYMBOL_MATCH_THRESHOLD = 1.4;
+
+struct MatchThresholds {
+	double match = SYMBOL_MATCH_THRESHOLD;
+	int size_diff = SYMBOL_SIZE_DIFF_THRESHOLD;
+};
+
+enum class Segmentation {
+	EMPTY_COLUMNS, // symbols are separated by empty columns
+	CONNECTED_COMPONENTS, // see split_into_symbol_groups_by_components()
+};
+
 std::variant<std::string, UntexFailure>
 untex_img(const Matrix<int>& img,
           const SymbolDatabase& symbol_database,
-          bool be_verbose);
+          Segmentation segmentation = Segmentation::EMPTY_COLUMNS,
+          const SymbolVpTree* symbol_index = nullptr);
+
+// Best match of a symbol candidate among the database symbols differing from
+// it in size by at most size_diff
+struct RecordedMatch {
+	double diff;
+	uint32_t symbol; // index in SymbolDatabase::symbols()
+	uint32_t size_diff;
+};
+
+// Matches of every symbol candidate (pair of DP position and symbol group, in
+// the order the DP visits them) of an image. Matches of the i-th candidate are
+// matches[begins[i]], ..., matches[begins[i + 1] - 1] ordered by size_diff;
+// every one of them is better than all the preceding ones.
+struct RecordedMatchesView {
+	const uint32_t* begins; // pairs + 1 elements
+	size_t pairs;
+	const RecordedMatch* matches;
+};
+
+struct RecordedMatches {
+	std::vector<uint32_t> begins {0};
+	std::vector<RecordedMatch> matches;
+
+	RecordedMatchesView view() const noexcept {
+		return {begins.data(), begins.size() - 1, matches.data()};
+	}
+};
+
+// Compares every symbol candidate of @p img (also the ones untex_img() would
+// skip) with the database symbols within the @p max thresholds, so that
+// replay_untex() can untex @p img with any smaller thresholds without
+// comparing images again
+RecordedMatches record_matches(const Matrix<int>& img,
+                               const SymbolDatabase& symbol_database,
+                               Segmentation segmentation,
+                               MatchThresholds max);
+
+// Untexes @p img once for every element of @p thresholds, like untex_img()
+// with these thresholds would, using matches recorded by record_matches()
+// with the same database and segmentation
+std::vector<std::variant<std::string, UntexFailure>>
+replay_untex(const Matrix<int>& img,
+             const SymbolDatabase& symbol_database,
+             Segmentation segmentation,
+             RecordedMatchesView recorded,
+             const std::vector<MatchThresholds>& thresholds);
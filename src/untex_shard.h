@@ -0,0 +1,177 @@
+#pragma once
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstdio>
+#include <fstream>
+#include <iomanip>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// The index-th of count disjoint parts of a list of images, chosen by a hash
+// of the image paths, so that processes sharing nothing (on one or many
+// machines) can each untex one part of the same list. The hash (64-bit
+// FNV-1a) does not depend on the platform or on the order of the list.
+struct Shard {
+	uint32_t index = 0;
+	uint32_t count = 1;
+
+	// Parses a nonempty string of decimal digits (no sign or whitespace)
+	static bool parse_number(std::string_view str, uint32_t& x) noexcept {
+		auto end = str.data() + str.size();
+		auto [ptr, ec] = std::from_chars(str.data(), end, x);
+		return not str.empty() and ec == std::errc() and ptr == end;
+	}
+
+	// Parses "<index>/<count>", e.g. "2/8"
+	static Shard parse(std::string_view spec) {
+		Shard res;
+		size_t slash = spec.find('/');
+		if (slash == std::string_view::npos or
+		    not parse_number(spec.substr(0, slash), res.index) or
+		    not parse_number(spec.substr(slash + 1), res.count) or
+		    res.count == 0 or res.index >= res.count) {
+			throw std::runtime_error("Invalid shard: " + std::string(spec));
+		}
+
+		return res;
+	}
+
+	bool contains(std::string_view path) const noexcept {
+		uint64_t hash = 0xcbf29ce484222325;
+		for (unsigned char c : path)
+			hash = (hash ^ c) * 0x100000001b3;
+
+		return hash % count == index;
+	}
+};
+
+// Summary of an untex run over a shard or of merged runs over many shards.
+// It is stored as lines "<key> <value>", one "shard <index>" line per covered
+// shard.
+struct UntexStats {
+	uint32_t shards_num = 1; // count of the shards the images were split into
+	std::vector<uint32_t> shards; // sorted indexes of the covered shards
+	uint64_t images = 0; // in the covered shards
+	uint64_t untexed = 0;
+	uint64_t failed = 0;
+	uint64_t unreadable = 0;
+	uint64_t verified = 0;
+	double confidence_sum = 0; // of the verified images
+	double seconds = 0; // summed over the runs
+
+	explicit UntexStats(Shard shard = {})
+	   : shards_num(shard.count), shards{shard.index} {}
+
+	// Throws if @p other covers any of the same shards or a different split
+	void merge(const UntexStats& other) {
+		if (other.shards_num != shards_num)
+			throw std::runtime_error("Merged shards of different splits");
+
+		std::vector<uint32_t> merged;
+		std::merge(shards.begin(),
+		           shards.end(),
+		           other.shards.begin(),
+		           other.shards.end(),
+		           std::back_inserter(merged));
+		if (std::adjacent_find(merged.begin(), merged.end()) != merged.end())
+			throw std::runtime_error("Merged the same shard twice");
+
+		shards = std::move(merged);
+		images += other.images;
+		untexed += other.untexed;
+		failed += other.failed;
+		unreadable += other.unreadable;
+		verified += other.verified;
+		confidence_sum += other.confidence_sum;
+		seconds += other.seconds;
+	}
+
+	std::vector<uint32_t> missing_shards() const {
+		std::vector<uint32_t> res;
+		for (uint32_t i = 0, k = 0; i < shards_num; ++i) {
+			if (k < shards.size() and shards[k] == i)
+				++k;
+			else
+				res.emplace_back(i);
+		}
+
+		return res;
+	}
+
+	// Replaces @p filename at once, so it is never seen partially written
+	void write(const std::string& filename) const {
+		std::string tmp_file = filename + ".tmp";
+		{
+			std::ofstream file(tmp_file);
+			file << std::setprecision(12) << "shards " << shards_num << '\n';
+			for (uint32_t shard : shards)
+				file << "shard " << shard << '\n';
+			file << "images " << images << '\n'
+			     << "untexed " << untexed << '\n'
+			     << "failed " << failed << '\n'
+			     << "unreadable " << unreadable << '\n'
+			     << "verified " << verified << '\n'
+			     << "confidence_sum " << confidence_sum << '\n'
+			     << "seconds " << seconds << '\n';
+			if (not file.flush())
+				throw std::runtime_error("Failed to write " + tmp_file);
+		}
+
+		if (rename(tmp_file.c_str(), filename.c_str()) != 0)
+			throw std::runtime_error("Failed to replace " + filename);
+	}
+
+	static UntexStats read(const std::string& filename) {
+		std::ifstream file(filename);
+		if (not file.is_open())
+			throw std::runtime_error("Failed to open " + filename);
+
+		UntexStats res;
+		res.shards.clear();
+		std::string key;
+		while (file >> key) {
+			bool ok = true;
+			std::string value;
+			if (key == "shards") {
+				ok = (file >> value and
+				      Shard::parse_number(value, res.shards_num) and
+				      res.shards_num > 0);
+			} else if (key == "shard") {
+				ok = (file >> value and
+				      Shard::parse_number(value, res.shards.emplace_back()));
+			} else if (key == "images") {
+				ok = bool(file >> res.images);
+			} else if (key == "untexed") {
+				ok = bool(file >> res.untexed);
+			} else if (key == "failed") {
+				ok = bool(file >> res.failed);
+			} else if (key == "unreadable") {
+				ok = bool(file >> res.unreadable);
+			} else if (key == "verified") {
+				ok = bool(file >> res.verified);
+			} else if (key == "confidence_sum") {
+				ok = bool(file >> res.confidence_sum);
+			} else if (key == "seconds") {
+				ok = bool(file >> res.seconds);
+			} else {
+				ok = false;
+			}
+
+			if (not ok)
+				throw std::runtime_error("Invalid stats file " + filename);
+		}
+
+		std::sort(res.shards.begin(), res.shards.end());
+		if (res.shards.empty() or res.shards.back() >= res.shards_num or
+		    std::adjacent_find(res.shards.begin(), res.shards.end()) !=
+		       res.shards.end()) {
+			throw std::runtime_error("Invalid shards in " + filename);
+		}
+
+		return res;
+	}
+};